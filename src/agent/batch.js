@@ -0,0 +1,198 @@
+'use strict';
+
+const config = require('./config');
+const symcache = require('./symcache');
+const wire = require('./wire');
+
+/* record kinds, must match the RFBatchKind enum in io_frida.c */
+const LOG = 0;
+const LOG_FILE = 1;
+
+/* flat list of kind, message, backtrace triples */
+const STRIDE = 3;
+const queue = [];
+let queueFile = '';
+let timer = null;
+let timerDue = 0;
+let lastFlush = 0;
+const counters = {
+  queued: 0,
+  sent: 0,
+  batches: 0,
+  dropped: 0
+};
+
+module.exports = {
+  LOG,
+  LOG_FILE,
+  push,
+  flush,
+  stats,
+  utf8Encode
+};
+
+function push (kind, message, filename, backtrace) {
+  if (kind === LOG_FILE && filename !== queueFile) {
+    flush();
+    queueFile = filename;
+  }
+  if (queue.length / STRIDE >= Math.max(1, +config.get('hook.batch.queue') >> 0)) {
+    counters.dropped++;
+    return false;
+  }
+  queue.push(kind, message, backtrace);
+  counters.queued++;
+  const interval = +config.get('hook.batch.interval') >> 0;
+  if (interval <= 0) {
+    flush();
+  } else if (queue.length / STRIDE >= +config.get('hook.batch.size')) {
+    _schedule(lastFlush + interval);
+  } else {
+    _schedule(Date.now() + interval);
+  }
+  return true;
+}
+
+/*
+ * batches never leave from within a hook: a full batch goes out on a later turn of the
+ * event loop, at most one every hook.batch.interval, so a backlog builds up in the queue
+ */
+function _schedule (due) {
+  if (timer !== null) {
+    if (due >= timerDue) {
+      return;
+    }
+    clearTimeout(timer);
+  }
+  timerDue = due;
+  timer = setTimeout(_tick, Math.max(0, due - Date.now()));
+}
+
+function _tick () {
+  timer = null;
+  _send(Math.max(1, +config.get('hook.batch.size') >> 0));
+  if (queue.length > 0) {
+    _schedule(lastFlush + Math.max(1, +config.get('hook.batch.interval') >> 0));
+  }
+}
+
+function flush () {
+  if (timer !== null) {
+    clearTimeout(timer);
+    timer = null;
+  }
+  _send(queue.length / STRIDE);
+}
+
+/* [u8 kind][u32le length][utf8 message] for up to max queued records, sent as one message */
+function _send (max) {
+  if (queue.length === 0) {
+    return;
+  }
+  lastFlush = Date.now();
+  const records = queue.splice(0, max * STRIDE);
+  const count = records.length / STRIDE;
+  const texts = new Array(count);
+  let size = 0;
+  const jsonl = config.getString('file.log.format') === 'jsonl';
+  for (let i = 0; i < count; i++) {
+    const msg = symcache.render(records[i * STRIDE + 1], records[i * STRIDE + 2]);
+    texts[i] = _format(records[i * STRIDE], msg, jsonl);
+    size += 5 + utf8Length(texts[i]);
+  }
+  // encoded in place, one allocation per batch
+  const buf = new Uint8Array(size);
+  const view = new DataView(buf.buffer);
+  let off = 0;
+  for (let i = 0; i < count; i++) {
+    buf[off] = records[i * STRIDE];
+    const end = utf8EncodeInto(texts[i], buf, off + 5);
+    view.setUint32(off + 1, end - off - 5, true);
+    off = end;
+  }
+  counters.sent += count;
+  counters.batches++;
+  wire.send({
+    name: 'log-batch',
+    stanza: {
+      count: count,
+      filename: queueFile,
+      dropped: counters.dropped,
+      flush: +config.get('file.log.flush'),
+      buffer: +config.get('file.log.buffer'),
+      rotate: +config.get('file.log.rotate')
+    }
+  }, buf.buffer);
+}
+
+function _format (kind, msg, jsonl) {
+  if (kind === LOG_FILE && jsonl) {
+    return JSON.stringify((typeof msg === 'string') ? { message: msg } : msg);
+  }
+  return (typeof msg === 'string') ? msg : JSON.stringify(msg);
+}
+
+function stats () {
+  return {
+    'batch.depth': queue.length / STRIDE,
+    'batch.queued': counters.queued,
+    'batch.sent': counters.sent,
+    'batch.batches': counters.batches,
+    'batch.dropped': counters.dropped
+  };
+}
+
+/* bytes needed to encode str as utf-8, lone surrogates take 3 like the replacement would */
+function utf8Length (str) {
+  let n = 0;
+  for (let i = 0; i < str.length; i++) {
+    const c = str.charCodeAt(i);
+    if (c < 0x80) {
+      n++;
+    } else if (c < 0x800) {
+      n += 2;
+    } else if (c >= 0xd800 && c < 0xdc00 && i + 1 < str.length && (str.charCodeAt(i + 1) & 0xfc00) === 0xdc00) {
+      n += 4;
+      i++;
+    } else {
+      n += 3;
+    }
+  }
+  return n;
+}
+
+/* writes str at off, out must have room for utf8Length(str) bytes, returns the offset past it */
+function utf8EncodeInto (str, out, off) {
+  for (let i = 0; i < str.length; i++) {
+    let c = str.charCodeAt(i);
+    if (c >= 0xd800 && c < 0xdc00 && i + 1 < str.length) {
+      const next = str.charCodeAt(i + 1);
+      if (next >= 0xdc00 && next < 0xe000) {
+        c = 0x10000 + ((c - 0xd800) << 10) + (next - 0xdc00);
+        i++;
+      }
+    }
+    if (c < 0x80) {
+      out[off++] = c;
+    } else if (c < 0x800) {
+      out[off++] = 0xc0 | (c >> 6);
+      out[off++] = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+      out[off++] = 0xe0 | (c >> 12);
+      out[off++] = 0x80 | ((c >> 6) & 0x3f);
+      out[off++] = 0x80 | (c & 0x3f);
+    } else {
+      out[off++] = 0xf0 | (c >> 18);
+      out[off++] = 0x80 | ((c >> 12) & 0x3f);
+      out[off++] = 0x80 | ((c >> 6) & 0x3f);
+      out[off++] = 0x80 | (c & 0x3f);
+    }
+  }
+  return off;
+}
+
+function utf8Encode (str) {
+  const out = new Uint8Array(utf8Length(str));
+  utf8EncodeInto(str, out, 0);
+  return out;
+}
@@ -0,0 +1,266 @@
+'use strict';
+
+const coverage = require('./coverage');
+
+/* caller -> callee edge counts aggregated natively when stalker.event=callgraph, see \dtg */
+const entrySize = 24;
+
+const cSource = `
+#include <gum/gumstalker.h>
+
+#define R2F_CG_THREADS 1024
+#define R2F_CG_MAX_RANGES 4096
+
+typedef struct {
+  guint64 site;
+  guint64 target;
+  guint32 tid;
+  guint32 count;
+} R2FEdge;
+
+/* every thread owns a table, its lock is only contended while \\dtg copies or clears it */
+typedef struct {
+  volatile gint lock;
+  volatile gint tid;
+  R2FEdge * table;
+  guint capacity;
+  guint count;
+} R2FThreadEdges;
+
+static R2FThreadEdges threads[R2F_CG_THREADS];
+/* threads that find no free slot above share this one */
+static R2FThreadEdges overflow;
+
+/* start, end pairs sorted by address, no ranges means everywhere. never freed, so a late event reads stale ranges at worst */
+static guint64 ranges[R2F_CG_MAX_RANGES * 2];
+static volatile guint n_ranges = 0;
+
+static gboolean in_ranges (guint64 address) {
+  guint lo = 0, hi = n_ranges;
+  if (hi == 0) {
+    return TRUE;
+  }
+  while (lo < hi) {
+    guint mid = (lo + hi) / 2;
+    if (address < ranges[mid * 2]) {
+      hi = mid;
+    } else if (address >= ranges[mid * 2 + 1]) {
+      lo = mid + 1;
+    } else {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static void acquire (R2FThreadEdges * te) {
+  while (!g_atomic_int_compare_and_exchange (&te->lock, 0, 1)) {
+  }
+}
+
+static void release (R2FThreadEdges * te) {
+  g_atomic_int_compare_and_exchange (&te->lock, 1, 0);
+}
+
+static R2FThreadEdges * thread_edges (guint32 tid) {
+  guint n, i = (tid * 2654435761U) & (R2F_CG_THREADS - 1);
+  for (n = 0; n < R2F_CG_THREADS; n++) {
+    gint owner = threads[i].tid;
+    if (owner == (gint) tid) {
+      return &threads[i];
+    }
+    if (owner == 0 && g_atomic_int_compare_and_exchange (&threads[i].tid, 0, (gint) tid)) {
+      return &threads[i];
+    }
+    i = (i + 1) & (R2F_CG_THREADS - 1);
+  }
+  return &overflow;
+}
+
+static R2FEdge * slot (R2FEdge * t, guint cap, guint64 site, guint64 target, guint32 tid) {
+  guint i = (guint) (((site >> 2) ^ (target << 3) ^ tid) * 2654435761U) & (cap - 1);
+  while (t[i].site != 0 && (t[i].site != site || t[i].target != target || t[i].tid != tid)) {
+    i = (i + 1) & (cap - 1);
+  }
+  return &t[i];
+}
+
+static void grow (R2FThreadEdges * te) {
+  guint i, cap = te->capacity ? te->capacity * 2 : 1024;
+  R2FEdge * t = g_malloc0 (cap * sizeof (R2FEdge));
+  for (i = 0; i < te->capacity; i++) {
+    if (te->table[i].site != 0) {
+      *slot (t, cap, te->table[i].site, te->table[i].target, te->table[i].tid) = te->table[i];
+    }
+  }
+  g_free (te->table);
+  te->table = t;
+  te->capacity = cap;
+}
+
+void on_event (const GumEvent * event, GumCpuContext * cpu_context, gpointer user_data) {
+  const GumCallEvent * call = &event->call;
+  guint32 tid;
+  R2FThreadEdges * te;
+  R2FEdge * e;
+  if (event->type != GUM_CALL || !in_ranges (GPOINTER_TO_SIZE (call->location))) {
+    return;
+  }
+  tid = gum_process_get_current_thread_id ();
+  te = thread_edges (tid);
+  acquire (te);
+  if ((te->count + 1) * 2 > te->capacity) {
+    grow (te);
+  }
+  e = slot (te->table, te->capacity, GPOINTER_TO_SIZE (call->location), GPOINTER_TO_SIZE (call->target), tid);
+  if (e->site == 0) {
+    e->site = GPOINTER_TO_SIZE (call->location);
+    e->target = GPOINTER_TO_SIZE (call->target);
+    e->tid = tid;
+    te->count++;
+  }
+  e->count++;
+  release (te);
+}
+
+static guint each_table (guint (* fn) (R2FThreadEdges *, R2FEdge *, guint), R2FEdge * out, guint max) {
+  guint i, n = 0;
+  for (i = 0; i < R2F_CG_THREADS; i++) {
+    if (threads[i].tid != 0) {
+      acquire (&threads[i]);
+      n += fn (&threads[i], out ? out + n : NULL, max - n);
+      release (&threads[i]);
+    }
+  }
+  acquire (&overflow);
+  n += fn (&overflow, out ? out + n : NULL, max - n);
+  release (&overflow);
+  return n;
+}
+
+static guint count_table (R2FThreadEdges * te, R2FEdge * out, guint max) {
+  return te->count;
+}
+
+static guint copy_table (R2FThreadEdges * te, R2FEdge * out, guint max) {
+  guint i, n = 0;
+  for (i = 0; i < te->capacity && n < max; i++) {
+    if (te->table[i].site != 0) {
+      out[n++] = te->table[i];
+    }
+  }
+  return n;
+}
+
+static guint clear_table (R2FThreadEdges * te, R2FEdge * out, guint max) {
+  g_free (te->table);
+  te->table = NULL;
+  te->capacity = 0;
+  te->count = 0;
+  return 0;
+}
+
+guint r2f_cg_count (void) {
+  return each_table (count_table, NULL, (guint) -1);
+}
+
+/* the per thread tables are merged here, outside of the stalked threads */
+guint r2f_cg_copy (R2FEdge * out, guint max) {
+  return each_table (copy_table, out, max);
+}
+
+void r2f_cg_set_ranges (const guint64 * r, guint n) {
+  guint i;
+  if (n > R2F_CG_MAX_RANGES) {
+    n = R2F_CG_MAX_RANGES;
+  }
+  n_ranges = 0;
+  for (i = 0; i < n * 2; i++) {
+    ranges[i] = r[i];
+  }
+  n_ranges = n;
+}
+
+void r2f_cg_clear (void) {
+  each_table (clear_table, NULL, 0);
+}
+`;
+
+let cm = null;
+let api = null;
+
+module.exports = {
+  onEvent,
+  setRanges,
+  count,
+  edges,
+  clear
+};
+
+function _init () {
+  if (cm !== null) {
+    return;
+  }
+  cm = new CModule(cSource);
+  api = {
+    count: new NativeFunction(cm.r2f_cg_count, 'uint', []),
+    copy: new NativeFunction(cm.r2f_cg_copy, 'uint', ['pointer', 'uint']),
+    clear: new NativeFunction(cm.r2f_cg_clear, 'void', []),
+    setRanges: new NativeFunction(cm.r2f_cg_set_ranges, 'void', ['pointer', 'uint'])
+  };
+}
+
+/* calls made outside of the [start, end] pairs are not counted, an empty list counts everything */
+function setRanges (ranges) {
+  _init();
+  api.setRanges(coverage.packRanges(ranges), ranges.length);
+}
+
+function onEvent () {
+  _init();
+  return cm.on_event;
+}
+
+function count () {
+  return (api === null) ? 0 : api.count();
+}
+
+/* most frequent first, edges of all threads are merged unless perThread is set */
+function edges (perThread) {
+  const n = count();
+  if (n === 0) {
+    return [];
+  }
+  const buf = Memory.alloc(n * entrySize);
+  const copied = api.copy(buf, n);
+  const merged = {};
+  const res = [];
+  for (let i = 0; i < copied; i++) {
+    const entry = buf.add(i * entrySize);
+    const edge = {
+      site: ptr('0x' + entry.readU64().toString(16)),
+      target: ptr('0x' + entry.add(8).readU64().toString(16)),
+      tid: entry.add(16).readU32(),
+      count: entry.add(20).readU32()
+    };
+    if (perThread) {
+      res.push(edge);
+      continue;
+    }
+    const key = edge.site + '-' + edge.target;
+    if (key in merged) {
+      merged[key].count += edge.count;
+    } else {
+      delete edge.tid;
+      merged[key] = edge;
+      res.push(edge);
+    }
+  }
+  return res.sort((a, b) => b.count - a.count);
+}
+
+function clear () {
+  if (api !== null) {
+    api.clear();
+  }
+}
@@ -8,11 +8,37 @@ const config = {
   'stalker.event': 'compile',
   'stalker.timeout': 5 * 60,
   'stalker.in': 'raw',
+  'stalker.file': '',
+  'stalker.modules': '',
+  'stalker.exclude': '',
+  'stalker.threads': '',
+  'stalker.threads.exclude': '',
+  'stalker.threads.poll': 500,
+  'stalker.queue.capacity': 16384,
+  'stalker.queue.drain': 250,
+  'sampler.hz': 100,
+  'sampler.depth': 0,
   'hook.backtrace': true,
   'hook.verbose': true,
   'hook.logs': true,
+  'hook.logs.size': 4096,
+  'hook.logs.policy': 'overwrite',
   'hook.output': 'simple',
+  'hook.sample': 1,
+  'hook.rate': 0,
+  'hook.limit': 0,
+  'hook.batch.interval': 50,
+  'hook.batch.size': 1024,
+  'hook.batch.queue': 65536,
   'file.log': '',
+  'file.log.format': 'text',
+  'file.log.flush': 1000,
+  'file.log.buffer': 65536,
+  'file.log.rotate': 0,
+  'reply.chunk': 65536,
+  'reply.file': '',
+  'io.compress': 'auto',
+  'io.compress.min': 4096,
   'symbols.unredact': Process.platform === 'darwin'
 };
 
@@ -22,11 +48,37 @@ const configHelp = {
   'stalker.event': configHelpStalkerEvent,
   'stalker.timeout': configHelpStalkerTimeout,
   'stalker.in': configHelpStalkerIn,
+  'stalker.file': configHelpStalkerFile,
+  'stalker.modules': configHelpStalkerModules,
+  'stalker.exclude': configHelpStalkerExclude,
+  'stalker.threads': configHelpStalkerThreads,
+  'stalker.threads.exclude': configHelpStalkerThreadsExclude,
+  'stalker.threads.poll': configHelpStalkerThreadsPoll,
+  'stalker.queue.capacity': configHelpStalkerQueueCapacity,
+  'stalker.queue.drain': configHelpStalkerQueueDrain,
+  'sampler.hz': configHelpSamplerHz,
+  'sampler.depth': configHelpSamplerDepth,
   'hook.backtrace': configHelpHookBacktrace,
   'hook.verbose': configHelpHookVerbose,
   'hook.logs': configHelpHookLogs,
+  'hook.logs.size': configHelpHookLogsSize,
+  'hook.logs.policy': configHelpHookLogsPolicy,
   'hook.output': configHelpHookOutput,
+  'hook.sample': configHelpHookSample,
+  'hook.rate': configHelpHookRate,
+  'hook.limit': configHelpHookLimit,
+  'hook.batch.interval': configHelpHookBatchInterval,
+  'hook.batch.size': configHelpHookBatchSize,
+  'hook.batch.queue': configHelpHookBatchQueue,
   'file.log': configHelpFileLog,
+  'file.log.format': configHelpFileLogFormat,
+  'file.log.flush': configHelpFileLogFlush,
+  'file.log.buffer': configHelpFileLogBuffer,
+  'file.log.rotate': configHelpFileLogRotate,
+  'reply.chunk': configHelpReplyChunk,
+  'reply.file': configHelpReplyFile,
+  'io.compress': configHelpIoCompress,
+  'io.compress.min': configHelpIoCompressMin,
   'symbols.unredact': configHelpSymbolsUnredact
 };
 
@@ -36,11 +88,37 @@ const configValidator = {
   'stalker.event': configValidateStalkerEvent,
   'stalker.timeout': configValidateStalkerTimeout,
   'stalker.in': configValidateStalkerIn,
+  'stalker.file': configValidateString,
+  'stalker.modules': configValidateString,
+  'stalker.exclude': configValidateString,
+  'stalker.threads': configValidateString,
+  'stalker.threads.exclude': configValidateString,
+  'stalker.threads.poll': configValidateNonNegative,
+  'stalker.queue.capacity': configValidateNonZero,
+  'stalker.queue.drain': configValidateNonNegative,
+  'sampler.hz': configValidateNonZero,
+  'sampler.depth': configValidateNonNegative,
   'hook.backtrace': configValidateBoolean,
   'hook.verbose': configValidateBoolean,
   'hook.logs': configValidateBoolean,
+  'hook.logs.size': configValidateNonZero,
+  'hook.logs.policy': configValidateHookLogsPolicy,
   'hook.output': configValidateString,
+  'hook.sample': configValidateNonZero,
+  'hook.rate': configValidateNonNegative,
+  'hook.limit': configValidateNonNegative,
+  'hook.batch.interval': configValidateNonNegative,
+  'hook.batch.size': configValidateNonZero,
+  'hook.batch.queue': configValidateNonZero,
   'file.log': configValidateString,
+  'file.log.format': configValidateFileLogFormat,
+  'file.log.flush': configValidateNonNegative,
+  'file.log.buffer': configValidateNonNegative,
+  'file.log.rotate': configValidateNonNegative,
+  'reply.chunk': configValidateNonZero,
+  'reply.file': configValidateString,
+  'io.compress': configValidateIoCompress,
+  'io.compress.min': configValidateNonNegative,
   'symbols.unredact': configValidateBoolean
 };
 
@@ -92,11 +170,13 @@ function configHelpStalkerEvent () {
     exec            trace every instruction
     block           trace basic block execution (every time)
     compile         trace basic blocks once (this is the default)
+    coverage        record unique basic blocks natively, see \\dtc
+    callgraph       count caller to callee edges natively, see \\dtg
   `;
 }
 
 function configValidateStalkerEvent (val) {
-  return ['call', 'ret', 'exec', 'block', 'compile'].indexOf(val) !== -1;
+  return ['call', 'ret', 'exec', 'block', 'compile', 'coverage', 'callgraph'].indexOf(val) !== -1;
 }
 
 function configHelpStalkerTimeout () {
@@ -108,6 +188,11 @@ function configValidateStalkerTimeout (val) {
   return val >= 0;
 }
 
+function configHelpStalkerFile () {
+  return `Write the \\dts and \\dtsf events to this file on the host instead of
+ showing them when the stalker finishes (empty by default)`;
+}
+
 function configHelpFileLog () {
   return `Set filename to save all the tracing logs generated by \\dt
 
@@ -115,6 +200,55 @@ function configHelpFileLog () {
   `;
 }
 
+function configHelpFileLogFormat () {
+  return `Format of the records written to file.log
+
+    text            one message per line (the default)
+    jsonl           one JSON object per line
+  `;
+}
+
+function configValidateFileLogFormat (val) {
+  return ['text', 'jsonl'].indexOf(val) !== -1;
+}
+
+function configHelpFileLogFlush () {
+  return `Milliseconds the host may keep file.log records buffered before writing them (1000 by default)`;
+}
+
+function configHelpFileLogBuffer () {
+  return `Bytes the host buffers before writing file.log records (65536 by default)`;
+}
+
+function configHelpFileLogRotate () {
+  return `Rotate file.log to file.log.1 when it grows past this many bytes (0 disables rotation)`;
+}
+
+function configHelpReplyChunk () {
+  return `Characters per message when long listings like \\iAs, \\dm or \\dtl are streamed to the host (65536 by default)`;
+}
+
+function configHelpReplyFile () {
+  return `Append streamed listings to this file on the host instead of printing them (empty by default)`;
+}
+
+function configHelpIoCompress () {
+  return `Compress the data of large messages sent to the host, see \\?z for the ratio
+
+    auto            only when the device is reached over usb or the network (the default)
+    lz4             always, useful when the agent is faster than the link
+    none            never
+  `;
+}
+
+function configValidateIoCompress (val) {
+  return ['auto', 'lz4', 'none'].indexOf(val) !== -1;
+}
+
+function configHelpIoCompressMin () {
+  return `Messages with less data bytes than this are sent as is (4096 by default)`;
+}
+
 function configHelpHookVerbose () {
   return `Show trace messages to the console. They are also logged in \\dtl
 
@@ -129,6 +263,22 @@ function configHelpHookLogs () {
   `;
 }
 
+function configHelpHookLogsSize () {
+  return `Maximum number of trace records kept by \\dtl (4096 by default)`;
+}
+
+function configHelpHookLogsPolicy () {
+  return `What to do when the trace log is full, drops are reported by \\dtls
+
+    overwrite       evict the oldest record (the default)
+    stop            keep the oldest records and drop new ones
+  `;
+}
+
+function configValidateHookLogsPolicy (val) {
+  return ['overwrite', 'stop'].indexOf(val) !== -1;
+}
+
 function configHelpHookOutput () {
   return `Choose output format.
 
@@ -136,6 +286,42 @@ function configHelpHookOutput () {
   `;
 }
 
+function configHelpHookSample () {
+  return `Emit one event every N hits of new trace points (1 by default), see \\dto`;
+}
+
+function configHelpHookRate () {
+  return `Maximum events per second emitted by new trace points (0 means unlimited)`;
+}
+
+function configHelpHookLimit () {
+  return `Disable new trace points after emitting this many events (0 means never)`;
+}
+
+function configHelpHookBatchInterval () {
+  return `Milliseconds to wait before sending queued trace events to the host
+ in a single message (50 by default), set to 0 to send every event right away.
+ Full batches are not sent more often than this either.`;
+}
+
+function configHelpHookBatchSize () {
+  return `Send the queued trace events as soon as this many are waiting, and never
+ more than this many in one message (1024 by default)`;
+}
+
+function configHelpHookBatchQueue () {
+  return `Maximum number of trace events waiting to be sent, the rest are dropped
+ and counted in \\dtls (65536 by default)`;
+}
+
+function configHelpSamplerHz () {
+  return `Snapshots of all threads taken per second by \\dps (100 by default)`;
+}
+
+function configHelpSamplerDepth () {
+  return `Return addresses unwound per thread and sample by \\dps for \\dpsc (0 only samples the pc)`;
+}
+
 function configHelpHookBacktrace () {
   return `Append the backtrace on each trace hook registered with \\dt commands
 
@@ -149,9 +335,42 @@ function configHelpStalkerIn () {
     raw             stalk everywhere (the default)
     app             stalk only in the app module
     modules         stalk in app module and all linked libraries
+
+  Events from other modules are dropped, use stalker.exclude to run them at native speed.
   `;
 }
 
+function configHelpStalkerModules () {
+  return `Comma separated list of module names or paths to stalk, * is a wildcard
+ (empty by default, see stalker.in)`;
+}
+
+function configHelpStalkerThreads () {
+  return `Comma separated list of thread ids or name patterns followed by \\dts (empty means all)`;
+}
+
+function configHelpStalkerThreadsExclude () {
+  return `Comma separated list of thread ids or name patterns \\dts never follows`;
+}
+
+function configHelpStalkerThreadsPoll () {
+  return `Milliseconds between checks for new threads to follow during \\dts (500 by default),
+ 0 only follows the threads alive when it starts`;
+}
+
+function configHelpStalkerQueueCapacity () {
+  return `Events each thread can queue natively before the stalker drops them (16384 by default)`;
+}
+
+function configHelpStalkerQueueDrain () {
+  return `Milliseconds between drains of the per-thread event queues (250 by default)`;
+}
+
+function configHelpStalkerExclude () {
+  return `Comma separated list of module names or paths never to stalk, like libc*,libSystem*
+ Excluded modules stay excluded until the agent is reloaded`;
+}
+
 function configHelpSymbolsUnredact () {
   return `Try to get symbol names from debug symbols when they're "redacted":
 
@@ -164,6 +383,14 @@ function configValidateStalkerIn (val) {
   return ['raw', 'app', 'modules'].indexOf(val) !== -1;
 }
 
+function configValidateNonNegative (val) {
+  return +val >= 0;
+}
+
+function configValidateNonZero (val) {
+  return +val > 0;
+}
+
 function configValidateString (val) {
   return typeof (val) === 'string';
 }
@@ -0,0 +1,259 @@
+'use strict';
+
+const { utf8Encode } = require('./batch');
+
+/* unique basic blocks recorded by a stalker transform when stalker.event=coverage, see \dtc */
+const cSource = `
+#include <gum/gumstalker.h>
+
+typedef struct {
+  guint64 start;
+  guint64 size;
+} R2FCovBlock;
+
+static volatile gint lock = 0;
+static R2FCovBlock * table = NULL;
+static guint capacity = 0;
+static guint count = 0;
+
+/* start, end pairs sorted by address, no ranges means everywhere */
+static guint64 * ranges = NULL;
+static guint n_ranges = 0;
+
+static gboolean in_ranges (guint64 address) {
+  guint lo = 0, hi = n_ranges;
+  if (n_ranges == 0) {
+    return TRUE;
+  }
+  while (lo < hi) {
+    guint mid = (lo + hi) / 2;
+    if (address < ranges[mid * 2]) {
+      hi = mid;
+    } else if (address >= ranges[mid * 2 + 1]) {
+      lo = mid + 1;
+    } else {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static void acquire (void) {
+  while (!g_atomic_int_compare_and_exchange (&lock, 0, 1)) {
+  }
+}
+
+static void release (void) {
+  g_atomic_int_compare_and_exchange (&lock, 1, 0);
+}
+
+static void insert (R2FCovBlock * t, guint cap, guint64 start, guint64 size) {
+  guint i = (guint) ((start >> 2) * 2654435761U) & (cap - 1);
+  while (t[i].start != 0) {
+    if (t[i].start == start) {
+      return;
+    }
+    i = (i + 1) & (cap - 1);
+  }
+  t[i].start = start;
+  t[i].size = size;
+  if (t == table) {
+    count++;
+  }
+}
+
+static void grow (void) {
+  guint i, cap = capacity ? capacity * 2 : 65536;
+  R2FCovBlock * t = g_malloc0 (cap * sizeof (R2FCovBlock));
+  for (i = 0; i < capacity; i++) {
+    if (table[i].start != 0) {
+      insert (t, cap, table[i].start, table[i].size);
+    }
+  }
+  g_free (table);
+  table = t;
+  capacity = cap;
+}
+
+/* blocks are compiled once per stalker session, so this is off the hot path */
+void transform (GumStalkerIterator * iterator, GumStalkerOutput * output, gpointer user_data) {
+  const cs_insn * insn;
+  guint64 start = 0, end = 0;
+  while (gum_stalker_iterator_next (iterator, &insn)) {
+    if (start == 0) {
+      start = insn->address;
+    }
+    end = insn->address + insn->size;
+    gum_stalker_iterator_keep (iterator);
+  }
+  if (start == 0) {
+    return;
+  }
+  acquire ();
+  if (in_ranges (start)) {
+    if ((count + 1) * 2 > capacity) {
+      grow ();
+    }
+    insert (table, capacity, start, end - start);
+  }
+  release ();
+}
+
+guint r2f_cov_count (void) {
+  return count;
+}
+
+guint r2f_cov_copy (R2FCovBlock * out, guint max) {
+  guint i, n = 0;
+  acquire ();
+  for (i = 0; i < capacity && n < max; i++) {
+    if (table[i].start != 0) {
+      out[n++] = table[i];
+    }
+  }
+  release ();
+  return n;
+}
+
+void r2f_cov_set_ranges (const guint64 * r, guint n) {
+  guint64 * copy = g_malloc (n * 2 * sizeof (guint64) + 1);
+  guint i;
+  for (i = 0; i < n * 2; i++) {
+    copy[i] = r[i];
+  }
+  acquire ();
+  g_free (ranges);
+  ranges = copy;
+  n_ranges = n;
+  release ();
+}
+
+void r2f_cov_clear (void) {
+  acquire ();
+  g_free (table);
+  table = NULL;
+  capacity = 0;
+  count = 0;
+  release ();
+}
+`;
+
+let cm = null;
+let api = null;
+
+module.exports = {
+  transform,
+  setRanges,
+  count,
+  blocks,
+  clear,
+  drcov,
+  packRanges
+};
+
+function _init () {
+  if (cm !== null) {
+    return;
+  }
+  cm = new CModule(cSource);
+  api = {
+    count: new NativeFunction(cm.r2f_cov_count, 'uint', []),
+    copy: new NativeFunction(cm.r2f_cov_copy, 'uint', ['pointer', 'uint']),
+    clear: new NativeFunction(cm.r2f_cov_clear, 'void', []),
+    setRanges: new NativeFunction(cm.r2f_cov_set_ranges, 'void', ['pointer', 'uint'])
+  };
+}
+
+/* blocks outside of the [start, end] pairs are not recorded, an empty list records everything */
+function setRanges (ranges) {
+  _init();
+  api.setRanges(packRanges(ranges), ranges.length);
+}
+
+function packRanges (ranges) {
+  const sorted = ranges.slice().sort((a, b) => a[0].compare(b[0]));
+  const buf = Memory.alloc(Math.max(1, sorted.length) * 16);
+  sorted.forEach(([start, end], i) => {
+    buf.add(i * 16).writeU64(uint64(start.toString()));
+    buf.add(i * 16 + 8).writeU64(uint64(end.toString()));
+  });
+  return buf;
+}
+
+function transform () {
+  _init();
+  return cm.transform;
+}
+
+function count () {
+  return (api === null) ? 0 : api.count();
+}
+
+/* sorted by address */
+function blocks () {
+  const n = count();
+  if (n === 0) {
+    return [];
+  }
+  const buf = Memory.alloc(n * 16);
+  const copied = api.copy(buf, n);
+  const res = [];
+  for (let i = 0; i < copied; i++) {
+    const entry = buf.add(i * 16);
+    res.push({ address: ptr('0x' + entry.readU64().toString(16)), size: entry.add(8).readU64().toNumber() });
+  }
+  return res.sort((a, b) => a.address.compare(b.address));
+}
+
+function clear () {
+  if (api !== null) {
+    api.clear();
+  }
+}
+
+/* drcov v2, blocks outside of any loaded module are left out */
+function drcov () {
+  const modules = Process.enumerateModules().sort((a, b) => a.base.compare(b.base));
+  const table = [];
+  for (const block of blocks()) {
+    const id = _moduleIndex(modules, block.address);
+    if (id !== -1) {
+      table.push([block.address.sub(modules[id].base).toInt32() >>> 0, Math.min(block.size, 0xffff), id]);
+    }
+  }
+  let header = 'DRCOV VERSION: 2\nDRCOV FLAVOR: drcov\n';
+  header += `Module Table: version 2, count ${modules.length}\n`;
+  header += 'Columns: id, base, end, entry, checksum, timestamp, path\n';
+  modules.forEach((m, id) => {
+    header += `${id}, ${m.base}, ${m.base.add(m.size)}, 0x0, 0x0, 0x0, ${m.path}\n`;
+  });
+  header += `BB Table: ${table.length} bbs\n`;
+  const head = utf8Encode(header);
+  const out = new Uint8Array(head.length + table.length * 8);
+  const view = new DataView(out.buffer);
+  out.set(head, 0);
+  table.forEach(([offset, size, id], i) => {
+    const off = head.length + i * 8;
+    view.setUint32(off, offset, true);
+    view.setUint16(off + 4, size, true);
+    view.setUint16(off + 6, id, true);
+  });
+  return { modules: modules.length, blocks: table.length, bytes: out.buffer };
+}
+
+function _moduleIndex (modules, address) {
+  let lo = 0;
+  let hi = modules.length - 1;
+  while (lo <= hi) {
+    const mid = (lo + hi) >> 1;
+    const m = modules[mid];
+    if (address.compare(m.base) < 0) {
+      hi = mid - 1;
+    } else if (address.compare(m.base.add(m.size)) >= 0) {
+      lo = mid + 1;
+    } else {
+      return mid;
+    }
+  }
+  return -1;
+}
@@ -3,32 +3,77 @@
 // TODO : implement tracelog eval var and dump trace info into this file
 // this cant be done from the agent-side
 
-const { stalkFunction, stalkEverything } = require('./stalker');
-const fs = require('./fs');
 const path = require('path');
 const config = require('./config');
 const io = require('./io');
 const isObjC = require('./isobjc');
-const strings = require('./strings');
-
-// registered as a plugin
-require('../../ext/swift-frida/examples/r2swida/index.js');
+const tracelog = require('./tracelog');
+const batch = require('./batch');
+const symcache = require('./symcache');
+const throttle = require('./throttle');
+const jobs = require('./jobs');
+const stream = require('./stream');
+const wire = require('./wire');
+const shm = require('./shm');
+
+/* heavy subsystems are only evaluated the first time one of their commands runs, see \\?m */
+const agentLoadStart = Date.now();
+const lazyModules = {};
+const stalker = lazyRequire('stalker', () => require('./stalker'));
+const fs = lazyRequire('fs', () => require('./fs'));
+const profiler = lazyRequire('profiler', () => require('./profiler'));
+const coverage = lazyRequire('coverage', () => require('./coverage'));
+const callgraph = lazyRequire('callgraph', () => require('./callgraph'));
+const sampler = lazyRequire('sampler', () => require('./sampler'));
+const strings = (bytes, options) => lazyLoad('strings', () => require('./strings'))(bytes, options);
+let swiftLoaded = false;
 
 let Gcwd = '/';
 
 /* ObjC.available is buggy on non-objc apps, so override this */
-const ObjCAvailable = (Process.platform === 'darwin') && ObjC && ObjC.available && ObjC.classes && typeof ObjC.classes.NSString !== 'undefined';
+let objcAvailableCache = null;
+let javaAvailableCache = null;
 const NeedsSafeIo = (Process.platform === 'linux' && Process.arch == 'arm' && Process.pointerSize == 4);
-const JavaAvailable = Java && Java.available;
+
+/* asking the runtime about ObjC or Java loads the bridge, so wait until a command needs to know */
+function ObjCAvailable () {
+  if (objcAvailableCache === null) {
+    objcAvailableCache = (Process.platform === 'darwin') && ObjC && ObjC.available && ObjC.classes && typeof ObjC.classes.NSString !== 'undefined';
+  }
+  return objcAvailableCache;
+}
+
+function JavaAvailable () {
+  if (javaAvailableCache === null) {
+    javaAvailableCache = !!(Java && Java.available);
+  }
+  return javaAvailableCache;
+}
+
+function lazyLoad (name, load) {
+  if (!(name in lazyModules)) {
+    const start = Date.now();
+    lazyModules[name] = { exports: load(), ms: Date.now() - start };
+  }
+  return lazyModules[name].exports;
+}
+
+function lazyRequire (name, load) {
+  return new Proxy({}, {
+    get (target, key) {
+      return lazyLoad(name, load)[key];
+    }
+  });
+}
 
 /* globals */
 const pointerSize = Process.pointerSize;
 
 var suspended = false;
 var tracehooks = {};
-var logs = [];
 var traces = {};
 var breakpoints = {};
+let traceSerial = 0;
 
 const allocPool = {};
 const pendingCmds = {};
@@ -88,6 +133,10 @@ function javaTraceExample () {
 }
 
 const commandHandlers = {
+  '&': jobStart,
+  '&l': jobList,
+  '&=': jobFetch,
+  '&-': jobCancel,
   E: evalNum,
   '?e': echo,
   '/': search,
@@ -105,6 +154,10 @@ const commandHandlers = {
   '/v4j': searchValueImplJson(4),
   '/v8j': searchValueImplJson(8),
   '?V': fridaVersion,
+  '?m': agentMemory,
+  '?mj': agentMemoryJson,
+  '?z': wireStats,
+  '?zj': wireStatsJson,
   // '.': // this is implemented in C
   i: dumpInfo,
   'i*': dumpInfoR2,
@@ -221,6 +274,11 @@ const commandHandlers = {
   dpj: getPidJson,
   dpt: listThreads,
   dptj: listThreadsJson,
+  dps: sampleProfile,
+  dpsm: sampleProfileModules,
+  dpsc: sampleProfileCollapsed,
+  dpsj: sampleProfileJson,
+  'dps-': sampleProfileClear,
   dr: dumpRegisters,
   'dr*': dumpRegistersR2,
   drr: dumpRegistersRecursively,
@@ -239,11 +297,19 @@ const commandHandlers = {
   'dt.': traceHere,
   'dt-': clearTrace,
   'dt-*': clearAllTrace,
+  dto: traceOptions,
   dtr: traceRegs,
+  dtp: profileFunctions,
+  dtpj: profileJson,
+  dtpt: profileThreads,
+  dtpr: profileReset,
+  'dtp-': profileRemove,
+  'dtp-*': profileRemoveAll,
   dtl: traceLogDump,
   'dtl*': traceLogDumpR2,
   dtlq: traceLogDumpQuiet,
   dtlj: traceLogDumpJson,
+  dtls: traceLogStats,
   'dtl-': traceLogClear,
   'dtl-*': traceLogClearAll,
   dts: stalkTraceEverything,
@@ -253,6 +319,16 @@ const commandHandlers = {
   dtsf: stalkTraceFunction,
   dtsfj: stalkTraceFunctionJson,
   'dtsf*': stalkTraceFunctionR2,
+  dtc: coverageSummary,
+  dtcj: coverageJson,
+  'dtc*': coverageR2,
+  dtcd: coverageDrcov,
+  'dtc-': coverageClear,
+  dtg: callGraph,
+  dtgt: callGraphThreads,
+  dtgj: callGraphJson,
+  'dtg*': callGraphR2,
+  'dtg-': callGraphClear,
   di: interceptHelp,
   dis: interceptRetString,
   di0: interceptRet0,
@@ -847,7 +923,7 @@ function setBreakpoint (name, address) {
         breakpoints[addrString].stopped = true;
         if (config.getBoolean('hook.backtrace')) {
           console.log(addr);
-          const bt = Thread.backtrace(this.context).map(DebugSymbol.fromAddress);
+          const bt = symcache.symbolicateAll(symcache.backtrace(this.context));
           console.log(bt.join('\n\t'));
         }
       }
@@ -931,9 +1007,9 @@ async function dumpInfoJson () {
     os: Process.platform,
     pid: getPid(),
     uid: _getuid(),
-    objc: ObjCAvailable,
+    objc: ObjCAvailable(),
     runtime: Script.runtime,
-    java: JavaAvailable,
+    java: JavaAvailable(),
     mainLoop: hasMainLoop(),
     pageSize: Process.pageSize,
     pointerSize: Process.pointerSize,
@@ -942,7 +1018,7 @@ async function dumpInfoJson () {
     cwd: getCwd(),
   };
 
-  if (JavaAvailable) {
+  if (JavaAvailable()) {
     await performOnJavaVM(() => {
       const ActivityThread = Java.use('android.app.ActivityThread');
       const app = ActivityThread.currentApplication();
@@ -1058,13 +1134,7 @@ function listAllSymbolsJson (args) {
   const modules = Process.enumerateModules().map(m => m.path);
   let res = [];
   for (const module of modules) {
-    const symbols = Module.enumerateSymbols(module)
-      .filter((r) => r.address.compare(ptr('0')) > 0 && r.name);
-    if (argName) {
-      res.push(...symbols.filter((s) => s.name.indexOf(argName) !== -1));
-    } else {
-      res.push(...symbols);
-    }
+    res.push(...moduleSymbols(module, argName));
     if (res.length > 100000) {
       res.forEach((r) => {
         console.error([r.address, r.moduleName, r.name].join(' '));
@@ -1079,12 +1149,28 @@ function listAllHelp (args) {
   return 'See \\ia? for more information. Those commands may take a while to run.';
 }
 
+/* streamed one module at a time, the whole table is never held in memory */
 function listAllSymbols (args) {
-  return listAllSymbolsJson(args)
-    .map(({ type, name, address }) => {
-      return [address, type[0], name].join(' ');
-    })
-    .join('\n');
+  const argName = args[0];
+  const modules = Process.enumerateModules().map(m => m.path);
+  let pending = [];
+  return stream.create(() => {
+    while (pending.length === 0) {
+      if (modules.length === 0) {
+        return null;
+      }
+      pending = moduleSymbols(modules.shift(), argName);
+    }
+    return pending.splice(0, 1024).map(({ type, name, address }) => {
+      return [address, type[0], name].join(' ') + '\n';
+    }).join('');
+  });
+}
+
+function moduleSymbols (module, argName) {
+  const symbols = Module.enumerateSymbols(module)
+    .filter((r) => r.address.compare(ptr('0')) > 0 && r.name);
+  return argName ? symbols.filter((s) => s.name.indexOf(argName) !== -1) : symbols;
 }
 
 function listAllSymbolsR2 (args) {
@@ -1428,14 +1514,14 @@ function listImportsJson (args) {
 }
 
 function listClassesLoadedJson (args) {
-  if (JavaAvailable) {
+  if (JavaAvailable()) {
     return listClasses(args);
   }
   return JSON.stringify(ObjC.enumerateLoadedClassesSync());
 }
 
 function listClassesLoaders (args) {
-  if (!JavaAvailable) {
+  if (!JavaAvailable()) {
     return 'Error: icL is only available on Android targets.';
   }
   var res = '';
@@ -1473,7 +1559,7 @@ function listClassesLoaders (args) {
 }
 
 function listClassesLoaded (args) {
-  if (JavaAvailable) {
+  if (JavaAvailable()) {
     return listClasses(args);
   }
   const results = ObjC.enumerateLoadedClassesSync();
@@ -1665,7 +1751,7 @@ function listClassMethodsJson (args) {
 }
 
 function listClassesJson (args, classMethods) {
-  if (JavaAvailable) {
+  if (JavaAvailable()) {
     return listJavaClassesJson(args, classMethods === true);
   }
   if (args.length === 0) {
@@ -1837,8 +1923,8 @@ function listMallocRangesR2 (args) {
 }
 
 function listMallocRanges (args) {
-  return squashRanges(listMallocRangesJson(args))
-    .map(_ => '' + _.base + ' - ' + _.base.add(_.size) + '  (' + _.size + ')').join('\n') + '\n';
+  return stream.fromArray(squashRanges(listMallocRangesJson(args)),
+    _ => '' + _.base + ' - ' + _.base.add(_.size) + '  (' + _.size + ')\n');
 }
 
 function listMemoryRangesHere (args) {
@@ -1945,18 +2031,16 @@ function listMemoryRangesR2 () {
 }
 
 function listMemoryRanges () {
-  return listMemoryRangesJson()
-    .map(({ base, size, protection, file }) =>
-      [
-        padPointer(base),
-        '-',
-        padPointer(base.add(size)),
-        protection,
-      ]
-        .concat((file !== undefined) ? [file.path] : [])
-        .join(' ')
-    )
-    .join('\n') + '\n';
+  return stream.fromArray(listMemoryRangesJson(), ({ base, size, protection, file }) =>
+    [
+      padPointer(base),
+      '-',
+      padPointer(base.add(size)),
+      protection,
+    ]
+      .concat((file !== undefined) ? [file.path] : [])
+      .join(' ') + '\n'
+  );
 }
 
 function listMemoryRangesJson () {
@@ -2020,6 +2104,49 @@ function listThreads () {
   }).join('\n') + '\n';
 }
 
+function sampleProfile (args) {
+  if (args.length === 0) {
+    return _sampleTable(sampler.flat());
+  }
+  const seconds = +args[0];
+  if (isNaN(seconds) || seconds <= 0) {
+    return 'Usage: dps [seconds]';
+  }
+  const hz = +config.get('sampler.hz');
+  const depth = +config.get('sampler.depth') >> 0;
+  return sampler.run(seconds, hz, depth).then(() => _sampleTable(sampler.flat()));
+}
+
+function sampleProfileModules () {
+  return _sampleTable(sampler.modules());
+}
+
+function sampleProfileCollapsed () {
+  return sampler.collapsed().join('\n') + '\n';
+}
+
+function sampleProfileJson () {
+  return JSON.stringify({
+    stats: sampler.stats(),
+    flat: sampler.flat(),
+    collapsed: sampler.collapsed()
+  });
+}
+
+function sampleProfileClear () {
+  sampler.clear();
+  return '';
+}
+
+function _sampleTable (rows) {
+  const { ticks, samples, elapsed, rate } = sampler.stats();
+  const header = `; ${samples} samples in ${ticks} ticks over ${elapsed}ms (${rate}Hz)\nself%\tself\ttotal\tname`;
+  return [header].concat(rows.map(({ name, self, total }) => {
+    const pct = samples ? (100 * self / samples).toFixed(2) : '0.00';
+    return [pct, self, total, name].join('\t');
+  })).join('\n') + '\n';
+}
+
 function listThreadsJson () {
   return Process.enumerateThreads()
     .map(thread => thread.id);
@@ -2403,9 +2530,12 @@ function _readUntrustedUtf8 (address, length) {
 }
 
 function traceList () {
-  let count = 0;
   return traceListeners.map((t) => {
-    return [count++, t.hits, t.at, t.source, t.moduleName, t.name, t.args].join('\t');
+    const row = [t.id, t.hits, t.gate ? t.gate.emitted : t.hits, t.at, t.source, t.moduleName, t.name, t.args];
+    if (t.gate && !throttle.isDefault(t.gate)) {
+      row.push(throttle.toString(t.gate));
+    }
+    return row.join('\t');
   }).join('\n') + '\n';
 }
 
@@ -2500,6 +2630,8 @@ function traceFormat (args) {
   if (args.length === 0) {
     return traceList();
   }
+  const parsed = throttle.parseOptions(args);
+  args = parsed.args;
   let address, format;
   const name = args[0];
   if (args.length === 2) {
@@ -2510,7 +2642,7 @@ function traceFormat (args) {
     format = '';
   } else {
     address = global.r2frida.offset;
-    format = args[0];
+    format = args[0] || '';
   }
   if (haveTraceAt(address)) {
     return 'There\'s already a trace in here';
@@ -2521,18 +2653,18 @@ function traceFormat (args) {
   const currentModule = Process.getModuleByAddress(address);
   const listener = Interceptor.attach(ptr(address), {
     myArgs: [],
-    myBacktrace: [],
     keepArgs: [],
     onEnter: function (args) {
       traceListener.hits++;
+      this.traced = traceAdmit(traceListener);
+      if (!this.traced) {
+        return;
+      }
       if (!traceOnEnter) {
         this.keepArgs = cloneArgs(args, format);
       } else {
         this.myArgs = formatArgs(args, format);
       }
-      if (traceBacktrace) {
-        this.myBacktrace = Thread.backtrace(this.context).map(DebugSymbol.fromAddress);
-      }
       if (traceOnEnter) {
         const traceMessage = {
           source: 'dtf',
@@ -2541,22 +2673,13 @@ function traceFormat (args) {
           timestamp: new Date(),
           values: this.myArgs,
         };
-        if (config.getBoolean('hook.backtrace')) {
-          traceMessage.backtrace = Thread.backtrace(this.context).map(DebugSymbol.fromAddress);
-        }
-        if (config.getString('hook.output') === 'json') {
-          traceEmit(traceMessage);
-        } else {
-          let msg = `[dtf onEnter][${traceMessage.timestamp}] ${name}@${address} - args: ${this.myArgs.join(', ')}`;
-          if (config.getBoolean('hook.backtrace')) {
-            msg += ` backtrace: ${traceMessage.backtrace.toString()}`;
-          }
-          traceEmit(msg);
-        }
+        const bt = (traceBacktrace || config.getBoolean('hook.backtrace'))
+          ? symcache.backtrace(this.context) : undefined;
+        traceEmit(traceMessage, traceListener.id, bt, config.getString('hook.output') !== 'json');
       }
     },
     onLeave: function (retval) {
-      if (!traceOnEnter) {
+      if (this.traced && !traceOnEnter) {
         this.myArgs = formatArgs(this.keepArgs, format);
         const traceMessage = {
           source: 'dtf',
@@ -2566,28 +2689,21 @@ function traceFormat (args) {
           values: this.myArgs,
           retval
         };
-        if (config.getBoolean('hook.backtrace')) {
-          traceMessage.backtrace = Thread.backtrace(this.context).map(DebugSymbol.fromAddress);
-        }
-        if (config.getString('hook.output') === 'json') {
-          traceEmit(traceMessage);
-        } else {
-          let msg = `[dtf onLeave][${traceMessage.timestamp}] ${name}@${address} - args: ${this.myArgs.join(', ')}. Retval: ${retval.toString()}`;
-          if (config.getBoolean('hook.backtrace')) {
-            msg += ` backtrace: ${traceMessage.backtrace.toString()}`;
-          }
-          traceEmit(msg);
-        }
+        const bt = (traceBacktrace || config.getBoolean('hook.backtrace'))
+          ? symcache.backtrace(this.context) : undefined;
+        traceEmit(traceMessage, traceListener.id, bt, config.getString('hook.output') !== 'json');
       }
     }
   });
   const traceListener = {
+    id: traceSerial++,
     source: 'dtf',
     hits: 0,
     at: ptr(address),
     name: name,
     moduleName: currentModule ? currentModule.name : '',
     format: format,
+    gate: throttle.create(parsed.options),
     listener: listener
   };
   traceListeners.push(traceListener);
@@ -2609,26 +2725,90 @@ function traceNameFromAddress (address) {
   return tl ? tl.moduleName + ':' + tl.name : '';
 }
 
-function traceLogDumpQuiet () {
-  return logs.map(({ address, timestamp }) =>
-    [address, timestamp, traceCountFromAddress(address), traceNameFromAddress(address)].join(' '))
-    .join('\n') + '\n';
+function traceLogDumpQuiet (args) {
+  return tracelog.records(tracelog.parseFilter(args)).map(({ trace, tid, timestamp, message }) => {
+    const address = message.address || '';
+    return [address, timestamp, tid, trace, traceCountFromAddress(address), traceNameFromAddress(address)].join(' ');
+  }).join('\n') + '\n';
 }
 
-function traceLogDumpJson () {
-  return JSON.stringify(logs);
+function traceLogDumpJson (args) {
+  return JSON.stringify(tracelog.records(tracelog.parseFilter(args)).map(_ => _.message));
 }
 
-function traceLogDumpR2 () {
+function traceLogDumpR2 (args) {
   let res = '';
-  for (const l of logs) {
-    if (l.script) {
-      res += l.script;
+  for (const { message } of tracelog.records(tracelog.parseFilter(args))) {
+    if (message.script) {
+      res += message.script;
     }
   }
   return res;
 }
 
+function profileFunctions (args) {
+  if (args.length === 0) {
+    return profileTable(profiler.report().map(r => [r, '']));
+  }
+  for (const arg of args) {
+    const address = getPtr(arg);
+    if (address === null || ptr(address).isNull()) {
+      throw new Error('Cannot resolve ' + arg);
+    }
+    const nm = (arg.startsWith('0x') || arg === '$$') ? nameFromAddress(address) : arg;
+    profiler.add(address, nm);
+  }
+  return '';
+}
+
+function profileThreads () {
+  const rows = [];
+  for (const r of profiler.report()) {
+    for (const tid of Object.keys(r.threads)) {
+      rows.push([Object.assign({}, r, r.threads[tid]), tid]);
+    }
+  }
+  return profileTable(rows);
+}
+
+/* times are printed in microseconds, percentiles are log2 bucket upper bounds */
+function profileTable (rows) {
+  const us = (ns) => (ns / 1000).toFixed(3);
+  const header = ['address', 'tid', 'calls', 'total', 'self', 'avg', 'p50', 'p90', 'p99', 'max', 'name'].join('\t');
+  return [header].concat(rows.map(([r, tid]) => {
+    return [r.address, tid, r.calls, us(r.total), us(r.self), us(r.avg), us(r.p50), us(r.p90), us(r.p99), us(r.max), r.name + (r.active ? '' : ' (detached)')].join('\t');
+  })).join('\n') + '\n' + _profileMissed();
+}
+
+function _profileMissed () {
+  const missed = profiler.missed();
+  return (missed > 0) ? `# ${missed} calls not profiled, every thread slot was taken\n` : '';
+}
+
+function profileJson () {
+  return JSON.stringify(profiler.report());
+}
+
+function profileReset () {
+  profiler.reset();
+  return '';
+}
+
+function profileRemove (args) {
+  args.forEach(arg => profiler.remove(getPtr(arg)));
+  return '';
+}
+
+function profileRemoveAll () {
+  profiler.removeAll();
+  return '';
+}
+
+function traceLogStats () {
+  const st = Object.assign(tracelog.stats(), batch.stats());
+  return Object.keys(st).map(k => k + '\t' + st[k]).join('\n') + '\n';
+}
+
 function objectToString (o) {
   // console.error(JSON.stringify(o));
   const r = Object.keys(o).map((k) => {
@@ -2650,6 +2830,9 @@ function objectToString (o) {
 }
 
 function tracelogToString (l) {
+  if (typeof l === 'string') {
+    return l;
+  }
   const line = [l.source, l.name || l.address, objectToString(l.values)].join('\t');
   const bt = (!l.backtrace) ? '' : l.backtrace.map((b) => {
     return ['', b.address, b.moduleName, b.name].join('\t');
@@ -2657,8 +2840,8 @@ function tracelogToString (l) {
   return line + bt;
 }
 
-function traceLogDump () {
-  return logs.map(tracelogToString).join('\n') + '\n';
+function traceLogDump (args) {
+  return stream.fromArray(tracelog.records(tracelog.parseFilter(args)), _ => tracelogToString(_.message) + '\n');
 }
 
 function traceLogClear (args) {
@@ -2668,32 +2851,30 @@ function traceLogClear (args) {
 }
 
 function traceLogClearAll () {
-  logs = [];
+  tracelog.clear();
   traces = {};
   return '';
 }
 
-function traceEmit (msg) {
+/*
+ * backtrace is a list of raw return addresses, see symcache.render(). asText hook messages
+ * are shown as their hook.output=simple line, only formatted here when they are printed now
+ */
+function traceEmit (msg, traceId, backtrace, asText) {
   const fileLog = config.getString('file.log');
   if (fileLog.length > 0) {
-    send(wrapStanza('log-file', {
-      filename: fileLog,
-      message: msg
-    }));
-  } else {
-    traceLog(msg);
+    batch.push(batch.LOG_FILE, asText ? tracelog.text(msg) : msg, fileLog, backtrace);
+  } else if (config.getBoolean('hook.verbose')) {
+    traceLog(asText ? tracelog.text(msg) : msg, backtrace);
   }
   if (config.getBoolean('hook.logs')) {
-    logs.push(msg);
+    tracelog.append(msg, traceId, Process.getCurrentThreadId(), backtrace, asText);
   }
-  global.r2frida.logs = logs;
 }
 
-function traceLog (msg) {
+function traceLog (msg, backtrace) {
   if (config.getBoolean('hook.verbose')) {
-    send(wrapStanza('log', {
-      message: msg
-    }));
+    batch.push(batch.LOG, msg, undefined, backtrace);
   }
 }
 
@@ -2711,6 +2892,8 @@ function haveTraceAt (address) {
 }
 
 function traceRegs (args) {
+  const parsed = throttle.parseOptions(args);
+  args = parsed.args;
   if (args.length < 1) {
     return 'Usage: dtr [name|address] [reg ...]';
   }
@@ -2723,6 +2906,7 @@ function traceRegs (args) {
   const listener = Interceptor.attach(address, traceFunction);
   function traceFunction (_) {
     traceListener.hits++;
+    const traced = traceAdmit(traceListener);
     const regState = {};
     rest.map((r) => {
       let regName = r;
@@ -2732,7 +2916,7 @@ function traceRegs (args) {
         this.context[kv[0]] = ptr(kv[1]); // set register value
         regName = kv[0];
         regValue = kv[1];
-      } else {
+      } else if (traced) {
         try {
           const rv = ptr(this.context[r]);
           regValue = rv;
@@ -2747,31 +2931,26 @@ function traceRegs (args) {
       }
       regState[regName] = regValue;
     });
+    if (!traced) {
+      return;
+    }
     const traceMessage = {
       source: 'dtr',
       address: address,
       timestamp: new Date(),
       values: regState,
     };
-    if (config.getBoolean('hook.backtrace')) {
-      traceMessage.backtrace = Thread.backtrace(this.context).map(DebugSymbol.fromAddress);
-    }
-    if (config.getString('hook.output') === 'json') {
-      traceEmit(traceMessage);
-    } else {
-      let msg = `[dtr][${traceMessage.timestamp}] ${address} - registers: ${JSON.stringify(regState)}`;
-      if (config.getBoolean('hook.backtrace')) {
-        msg += ` backtrace: ${traceMessage.backtrace.toString()}`;
-      }
-      traceEmit(msg);
-    }
+    const bt = config.getBoolean('hook.backtrace') ? symcache.backtrace(this.context) : undefined;
+    traceEmit(traceMessage, traceListener.id, bt, config.getString('hook.output') !== 'json');
   }
   const traceListener = {
+    id: traceSerial++,
     source: 'dtr',
     hits: 0,
     at: address,
     moduleName: currentModule ? currentModule.name : 'unknown',
     name: args[0],
+    gate: throttle.create(parsed.options),
     listener: listener,
     args: rest
   };
@@ -2784,11 +2963,12 @@ function traceHere () {
   args.forEach(address => {
     const at = DebugSymbol.fromAddress(ptr(address)) || '' + ptr(address);
     const listener = Interceptor.attach(ptr(address), function () {
-      const bt = Thread.backtrace(this.context).map(DebugSymbol.fromAddress);
+      const bt = symcache.symbolicateAll(symcache.backtrace(this.context));
       const at = nameFromAddress(address);
       console.log('Trace here probe hit at ' + address + '::' + at + '\n\t' + bt.join('\n\t'));
     });
     traceListeners.push({
+      id: traceSerial++,
       at: at,
       listener: listener
     });
@@ -2870,6 +3050,12 @@ function traceJson (args) {
   if (args.length === 0) {
     return traceListJson();
   }
+  const parsed = throttle.parseOptions(args);
+  const options = parsed.options;
+  args = parsed.args;
+  if (args.length === 0) {
+    return 'Usage: dt [name|address] .. [sample=N] [rate=N] [limit=N]';
+  }
   if (args[0].startsWith('java:')) {
     traceReal(args[0]);
     return;
@@ -2882,11 +3068,11 @@ function traceJson (args) {
       }
       const narg = getPtr(arg);
       if (narg) {
-        traceReal(arg, narg);
+        traceReal(arg, narg, options);
         pull();
       } else {
         numEval(arg).then(function (at) {
-          console.error(traceReal(arg, at));
+          console.error(traceReal(arg, at, options));
           pull();
         }).catch(reject);
       }
@@ -2972,7 +3158,7 @@ function tracehook (address, args) {
   return fmtarg;
 }
 
-function traceReal (name, addressString) {
+function traceReal (name, addressString, options) {
   if (arguments.length === 0) {
     return traceList();
   }
@@ -2999,6 +3185,10 @@ function traceReal (name, addressString) {
   }
   const currentModule = Process.getModuleByAddress(address);
   const listener = Interceptor.attach(address, function (args) {
+    traceListener.hits++;
+    if (!traceAdmit(traceListener)) {
+      return;
+    }
     const values = tracehook(address, args);
     const traceMessage = {
       source: 'dt',
@@ -3006,20 +3196,17 @@ function traceReal (name, addressString) {
       timestamp: new Date(),
       values: values,
     };
-    traceListener.hits++;
-    if (config.getString('hook.output') === 'json') {
-      traceEmit(traceMessage);
-    } else {
-      traceEmit(`[dt][${traceMessage.timestamp}] ${address} - args: ${JSON.stringify(values)}`);
-    }
+    traceEmit(traceMessage, traceListener.id, undefined, config.getString('hook.output') !== 'json');
   });
   const traceListener = {
+    id: traceSerial++,
     source: 'dt',
     at: address,
     hits: 0,
     name: name,
     moduleName: currentModule ? currentModule.name : 'unknown',
     args: '',
+    gate: throttle.create(options),
     listener: listener
   };
   traceListeners.push(traceListener);
@@ -3032,21 +3219,49 @@ function clearAllTrace (args) {
 }
 
 function clearTrace (args) {
-  if (args.length > 0 && +args[0] > 0) {
-    const res = [];
-    const nth = +args[0];
-    for (let i = 0; i < traceListeners.length; i++) {
-      const tl = traceListeners[i];
-      if (i === nth) {
+  if (args.length > 0) {
+    const id = +args[0];
+    const index = traceListeners.findIndex(tl => tl.id === id);
+    if (index !== -1) {
+      const tl = traceListeners.splice(index, 1)[0];
+      if (tl.listener) {
         tl.listener.detach();
-      } else {
-        res.push(tl);
       }
     }
   }
   return '';
 }
 
+function traceOptions (args) {
+  const { options, args: ids } = throttle.parseOptions(args);
+  const selected = traceListeners.filter(tl => tl.gate && (ids.length === 0 || ids.includes('*') || ids.includes('' + tl.id)));
+  if (Object.keys(options).length === 0) {
+    return selected.map(tl => [tl.id, tl.hits, tl.gate.emitted, tl.gate.suppressed, throttle.toString(tl.gate)].join('\t')).join('\n') + '\n';
+  }
+  if (ids.length === 0) {
+    return 'Usage: dto [id|*] [sample=N] [rate=N] [limit=N]';
+  }
+  for (const tl of selected) {
+    if (tl.gate.disabled) {
+      console.error(`Trace ${tl.id} reached its limit and was detached, add it again`);
+      continue;
+    }
+    throttle.update(tl.gate, options);
+  }
+  return '';
+}
+
+/* sampling, rate limit and auto-disable shared by the dt, dtf and dtr hooks */
+function traceAdmit (traceListener) {
+  const admitted = throttle.admit(traceListener.gate, traceListener.hits);
+  if (traceListener.gate.disabled && traceListener.listener) {
+    const listener = traceListener.listener;
+    traceListener.listener = null;
+    setTimeout(() => listener.detach(), 0);
+  }
+  return admitted;
+}
+
 function interceptHelp (args) {
   return 'Usage: di0, di1 or di-1 passing as argument the address to intercept';
 }
@@ -3171,131 +3386,143 @@ function stalkTraceEverythingJson (args) {
 }
 
 function _stalkTraceSomething (getEvents, args) {
-  return getEvents(args, (isBlock, events) => {
-    let previousSymbolName;
-    const result = [];
-    const threads = Object.keys(events);
-
-    for (const threadId of threads) {
-      result.push(`; --- thread ${threadId} --- ;`);
-      if (isBlock) {
-        result.push(..._mapBlockEvents(events[threadId], (address) => {
-          const pd = disasmOne(address, previousSymbolName);
-          previousSymbolName = getSymbolName(address);
-          return pd;
-        }, (begin, end) => {
-          previousSymbolName = null;
-          return '';
-        }));
-      } else {
-        result.push(...events[threadId].map((event) => {
-          const address = event[0];
-          const target = event[1];
-          const pd = disasmOne(address, previousSymbolName, target);
-          previousSymbolName = getSymbolName(address);
-          return pd;
-        }));
-      }
-    }
-    return result.join('\n') + '\n';
-  });
-
-  function disasmOne (address, previousSymbolName, target) {
-    let pd = disasm(address, 1, previousSymbolName);
-    if (pd.endsWith('\n')) {
-      pd = pd.slice(0, -1);
-    }
-    if (target) {
-      pd += ` ; ${target} ${getSymbolName(target)}`;
-    }
-    return pd;
-  }
+  return getEvents(args, 'text');
 }
 
 function _stalkTraceSomethingR2 (getEvents, args) {
-  return getEvents(args, (isBlock, events) => {
-    const result = [];
-    const threads = Object.keys(events);
-
-    for (const threadId of threads) {
-      if (isBlock) {
-        result.push(..._mapBlockEvents(events[threadId], (address) => {
-          return `dt+ ${address} 1`;
-        }));
-      } else {
-        result.push(...events[threadId].map((event) => {
-          const commands = [];
-
-          const location = event[0];
-          commands.push(`dt+ ${location} 1`);
+  return getEvents(args, 'r2');
+}
 
-          const target = event[1];
-          if (target) {
-            commands.push(`CC ${target} ${getSymbolName(target)} @ ${location}`);
-          }
-          return commands.join('\n') + '\n';
-        }));
-      }
-    }
+function _stalkTraceSomethingJson (getEvents, args) {
+  return getEvents(args, 'json');
+}
 
-    return result.join('\n') + '\n';
-  });
+function _stalkerConfig () {
+  return {
+    event: config.get('stalker.event'),
+    timeout: config.get('stalker.timeout'),
+    stalkin: config.get('stalker.in'),
+    modules: config.getString('stalker.modules'),
+    exclude: config.getString('stalker.exclude'),
+    threads: config.getString('stalker.threads'),
+    threadsExclude: config.getString('stalker.threads.exclude'),
+    threadsPoll: +config.get('stalker.threads.poll') >> 0,
+    queueCapacity: +config.get('stalker.queue.capacity') >> 0,
+    queueDrain: +config.get('stalker.queue.drain') >> 0,
+    file: config.getString('stalker.file')
+  };
 }
 
-function _stalkTraceSomethingJson (getEvents, args) {
-  return getEvents(args, (isBlock, events) => {
-    const result = {
-      event: config.get('stalker.event'),
-      threads: events
-    };
+/* the events were streamed to the host already, the reply carrying this tells it how to render them */
+function _stalkerDone (conf, mode, result) {
+  if (conf.event === 'coverage') {
+    return `${coverage.count()} unique blocks covered, see \\dtc`;
+  }
+  if (conf.event === 'callgraph') {
+    return `${callgraph.count()} call edges recorded, see \\dtg`;
+  }
+  return {
+    r2fStalker: {
+      session: result.session,
+      mode: mode,
+      threads: result.threads,
+      stats: result.stats
+    }
+  };
+}
 
-    return result;
-  });
+function isStalkerResult (value) {
+  return value !== null && typeof value === 'object' && value.r2fStalker !== undefined;
 }
 
-function _stalkFunctionAndGetEvents (args, eventsHandler) {
+function _stalkFunctionAndGetEvents (args, mode) {
   _requireFridaVersion(10, 3, 13);
 
   const at = getPtr(args[0]);
-  const conf = {
-    event: config.get('stalker.event'),
-    timeout: config.get('stalker.timeout'),
-    stalkin: config.get('stalker.in')
-  };
-  const isBlock = conf.event === 'block' || conf.event === 'compile';
-
-  const operation = stalkFunction(conf, at)
-    .then((events) => {
-      return eventsHandler(isBlock, events);
-    });
+  const conf = _stalkerConfig();
+  const operation = stalker.stalkFunction(conf, at)
+    .then((result) => _stalkerDone(conf, mode, result));
 
   breakpointContinue([]);
   return operation;
 }
 
-function _stalkEverythingAndGetEvents (args, eventsHandler) {
+function _stalkEverythingAndGetEvents (args, mode) {
   _requireFridaVersion(10, 3, 13);
 
   const timeout = (args.length > 0) ? +args[0] : null;
-  const conf = {
-    event: config.get('stalker.event'),
-    timeout: config.get('stalker.timeout'),
-    stalkin: config.get('stalker.in')
-  };
-  const isBlock = conf.event === 'block' || conf.event === 'compile';
-
-  const operation = stalkEverything(conf, timeout)
-    .then((events) => {
-      return eventsHandler(isBlock, events);
-    });
+  const conf = _stalkerConfig();
+  const operation = stalker.stalkEverything(conf, timeout)
+    .then((result) => _stalkerDone(conf, mode, result));
 
   breakpointContinue([]);
   return operation;
 }
 
-function getSymbolName (address) {
-  const ds = DebugSymbol.fromAddress(address);
-  return (ds.name === null || ds.name.indexOf('0x') === 0) ? '' : ds.name;
+function coverageSummary () {
+  const byModule = {};
+  const modules = new ModuleMap();
+  for (const block of coverage.blocks()) {
+    const m = modules.find(block.address);
+    const name = m ? m.name : 'unknown';
+    byModule[name] = (byModule[name] || 0) + 1;
+  }
+  return Object.keys(byModule).map(k => byModule[k] + '\t' + k).join('\n') + '\n';
+}
+
+function coverageJson () {
+  return JSON.stringify(coverage.blocks());
+}
+
+function coverageR2 () {
+  const flags = coverage.blocks().map(({ address, size }) => `f cov.${address.toString(16)} ${size} @ ${address}`);
+  return ['fs+coverage'].concat(flags, ['fs-']).join('\n') + '\n';
+}
+
+function coverageDrcov (args) {
+  if (args.length < 1) {
+    return 'Usage: dtcd [file]';
+  }
+  const { modules, blocks, bytes } = coverage.drcov();
+  wire.send(wrapStanza('dump-file', { filename: args[0] }), bytes);
+  return `${blocks} blocks in ${modules} modules written to ${args[0]}`;
+}
+
+function coverageClear () {
+  coverage.clear();
+  return '';
+}
+
+function _callGraphTable (edges) {
+  return edges.map(({ tid, count, site, target }) => {
+    const row = [count, site, target, symcache.symbolicate(target).name || ''];
+    return ((tid === undefined) ? row : [tid].concat(row)).join('\t');
+  }).join('\n') + '\n';
+}
+
+function callGraph () {
+  return _callGraphTable(callgraph.edges(false));
+}
+
+function callGraphThreads () {
+  return _callGraphTable(callgraph.edges(true));
+}
+
+function callGraphJson (args) {
+  return JSON.stringify(callgraph.edges(args[0] === 'threads'));
+}
+
+/* call xrefs plus a comment with the hit count on every call site */
+function callGraphR2 () {
+  return callgraph.edges(false).map(({ count, site, target }) => {
+    const name = symcache.symbolicate(target).name || target;
+    return `axC ${target} @ ${site}\nCC ${count} calls to ${name} @ ${site}`;
+  }).join('\n') + '\n';
+}
+
+function callGraphClear () {
+  callgraph.clear();
+  return '';
 }
 
 function _requireFridaVersion (major, minor, patch) {
@@ -3311,26 +3538,6 @@ function _requireFridaVersion (major, minor, patch) {
   }
 }
 
-function _mapBlockEvents (events, onInstruction, onBlock) {
-  const result = [];
-
-  events.forEach(([begin, end]) => {
-    if (typeof onBlock === 'function') {
-      result.push(onBlock(begin, end));
-    }
-    let cursor = begin;
-    while (cursor < end) {
-      const [instr, next] = _tolerantInstructionParse(cursor);
-      if (instr !== null) {
-        result.push(onInstruction(cursor));
-      }
-      cursor = next;
-    }
-  });
-
-  return result;
-}
-
 function _tolerantInstructionParse (address) {
   let instr = null;
   let cursor = address;
@@ -3434,6 +3641,9 @@ const requestHandlers = {
   read: io.read,
   write: io.write,
   state: state,
+  compression: wire.negotiate,
+  symbolicate: symbolicateAddresses,
+  shm: shm.attach,
   perform: perform,
   evaluate: evaluate,
 };
@@ -3444,6 +3654,18 @@ function state (params, data) {
   return [{}, null];
 }
 
+/* names for the call targets of a stalker trace that r2 has no flag for */
+function symbolicateAddresses (params) {
+  const names = params.addresses.map((address) => {
+    const sym = symcache.symbolicate(ptr(address));
+    if (sym.name === null || sym.name.startsWith('0x')) {
+      return '';
+    }
+    return (sym.moduleName ? sym.moduleName + '!' : '') + sym.name;
+  });
+  return [{ names }, null];
+}
+
 function isPromise (value) {
   return value !== null && typeof value === 'object' && typeof value.then === 'function';
 }
@@ -3469,6 +3691,71 @@ function getHelpMessage (prefix) {
     }).join('\n') + '\n';
 }
 
+function commandHandlerFor (name) {
+  const userHandler = global.r2frida.commandHandler(name);
+  const handler = userHandler !== undefined
+    ? userHandler : commandHandlers[name];
+  if (handler === undefined) {
+    if (!swiftLoaded) {
+      // the swift plugin registers its commands when evaluated, give it a chance before failing
+      swiftLoaded = true;
+      lazyLoad('swift', () => require('../../ext/swift-frida/examples/r2swida/index.js'));
+      return commandHandlerFor(name);
+    }
+    throw new Error('Unhandled command: ' + name);
+  }
+  if (isPromise(handler)) {
+    throw new Error("The handler can't be a promise");
+  }
+  return handler;
+}
+
+function jobStart (args) {
+  if (args.length === 0) {
+    return jobList();
+  }
+  const [name, ...rest] = args;
+  const handler = commandHandlerFor(name);
+  const job = jobs.start(args.join(' '), () => handler(rest), discardStalkerResult);
+  return `Job ${job.id} started, fetch its result with \\&= ${job.id}`;
+}
+
+/* the trace of a stalker job stays in the host until \\&= renders it */
+function discardStalkerResult (value) {
+  if (isStalkerResult(value)) {
+    send(wrapStanza('stalker-drop', { session: value.r2fStalker.session }));
+  }
+}
+
+function jobList () {
+  return jobs.list().map(({ id, status, elapsed, command }) => {
+    return [id, status, elapsed + 'ms', command].join('\t');
+  }).join('\n') + '\n';
+}
+
+function jobFetch (args) {
+  const job = jobs.take(+args[0]);
+  if (job === undefined) {
+    throw new Error('No such job: ' + args[0]);
+  }
+  switch (job.status) {
+    case 'running':
+      return `Job ${job.id} is still running`;
+    case 'failed':
+      throw new Error(job.error);
+    case 'cancelled':
+      return `Job ${job.id} was cancelled`;
+  }
+  return job.value;
+}
+
+function jobCancel (args) {
+  if (!jobs.cancel(+args[0])) {
+    throw new Error('No such job: ' + args[0]);
+  }
+  return '';
+}
+
 function perform (params) {
   const { command } = params;
 
@@ -3487,20 +3774,23 @@ function perform (params) {
       value: normalizeValue(value)
     }, null];
   }
-  const userHandler = global.r2frida.commandHandler(name);
-  const handler = userHandler !== undefined
-    ? userHandler : commandHandlers[name];
-  if (handler === undefined) {
-    throw new Error('Unhandled command: ' + name);
+  const handler = commandHandlerFor(name);
+  const value = handler(args);
+  if (stream.isStream(value)) {
+    return performStream(value);
   }
-
-  if (isPromise(handler)) {
-    throw new Error("The handler can't be a promise");
+  if (isStalkerResult(value)) {
+    return [{ stalker: value.r2fStalker }, null];
   }
-  const value = handler(args);
   if (isPromise(value)) {
     return new Promise((resolve, reject) => {
       return value.then(output => {
+        if (stream.isStream(output)) {
+          return performStream(output).then(resolve);
+        }
+        if (isStalkerResult(output)) {
+          return resolve([{ stalker: output.r2fStalker }, null]);
+        }
         resolve([{
           value: normalizeValue(output)
         }, null]);
@@ -3514,6 +3804,13 @@ function perform (params) {
   return [{ value: nv }, null];
 }
 
+/* the output already reached the host in chunks, the reply only says how many */
+function performStream (output) {
+  return stream.send(output).then(({ chunks, bytes }) => {
+    return [{ chunks, bytes }, null];
+  });
+}
+
 function normalizeValue (value) {
   if (typeof value === null || typeof value === undefined) {
     return null;
@@ -3530,9 +3827,9 @@ function normalizeValue (value) {
 function evaluate (params) {
   return new Promise(resolve => {
     let { code, ccode } = params;
-    const isObjcMainLoopRunning = ObjCAvailable && hasMainLoop();
+    const isObjcMainLoopRunning = ObjCAvailable() && hasMainLoop();
 
-    if (ObjCAvailable && isObjcMainLoopRunning && !suspended) {
+    if (ObjCAvailable() && isObjcMainLoopRunning && !suspended) {
       ObjC.schedule(ObjC.mainQueue, performEval);
     } else {
       performEval();
@@ -3604,6 +3901,33 @@ function fridaVersion () {
   return { version: Frida.version };
 }
 
+function agentMemory () {
+  const st = agentMemoryJson();
+  const loaded = Object.keys(st.loaded).map(k => `${k} (${st.loaded[k]}ms)`).join(' ');
+  return `heap\t${st.heap}\nstartup\t${st.startup}ms\nloaded\t${loaded}\n`;
+}
+
+/* gum heap in use and the time spent evaluating the agent and each subsystem loaded since */
+function agentMemoryJson () {
+  const loaded = {};
+  Object.keys(lazyModules).forEach(k => { loaded[k] = lazyModules[k].ms; });
+  return {
+    heap: Frida.heapSize,
+    startup: agentLoadTime,
+    loaded
+  };
+}
+
+function wireStats () {
+  const st = wireStatsJson();
+  return Object.keys(st).map(k => k + '\t' + st[k]).join('\n') + '\n';
+}
+
+/* raw and compressed only count the messages large enough to be considered, usec is spent compressing */
+function wireStatsJson () {
+  return wire.stats();
+}
+
 function search (args) {
   return searchJson(args).then(hits => {
     return _readableHits(hits);
@@ -4048,12 +4372,15 @@ function onStanza (stanza, data) {
   const handler = requestHandlers[stanza.type];
   if (handler !== undefined) {
     try {
+      if (stanza.payload.state !== undefined) {
+        state(stanza.payload.state);
+      }
       const value = handler(stanza.payload, data);
       if (value instanceof Promise) {
         // handle async stuff in here
         value
           .then(([replyStanza, replyBytes]) => {
-            send(wrapStanza('reply', replyStanza), replyBytes);
+            wire.send(wrapStanza('reply', replyStanza), replyBytes);
           })
           .catch(e => {
             send(wrapStanza('reply', {
@@ -4062,7 +4389,7 @@ function onStanza (stanza, data) {
           });
       } else {
         const [replyStanza, replyBytes] = value;
-        send(wrapStanza('reply', replyStanza), replyBytes);
+        wire.send(wrapStanza('reply', replyStanza), replyBytes);
       }
     } catch (e) {
       send(wrapStanza('reply', {
@@ -4073,6 +4400,8 @@ function onStanza (stanza, data) {
     console.error('Breakpoint handler');
   } else if (stanza.type === 'cmd') {
     onCmdResp(stanza.payload);
+  } else if (stanza.type === 'chunk-ack') {
+    stream.ack(stanza.payload);
   } else {
     console.error('Unhandled stanza: ' + stanza.type);
   }
@@ -4083,19 +4412,17 @@ function onStanza (stanza, data) {
 
 let cmdSerial = 0;
 
+/* all the commands travel in a single exchange, resolves to the array of their outputs */
 function hostCmds (commands) {
-  let i = 0;
-  function sendOne () {
-    if (i < commands.length) {
-      return hostCmd(commands[i]).then(() => {
-        i += 1;
-        return sendOne();
-      });
-    } else {
-      return Promise.resolve();
-    }
+  if (commands.length === 0) {
+    return Promise.resolve([]);
   }
-  return sendOne();
+  return new Promise((resolve) => {
+    const serial = cmdSerial;
+    cmdSerial++;
+    pendingCmds[serial] = resolve;
+    sendCommand({ cmds: commands, serial: serial });
+  });
 }
 
 function hostCmdj (cmd) {
@@ -4110,25 +4437,28 @@ function hostCmd (cmd) {
     const serial = cmdSerial;
     cmdSerial++;
     pendingCmds[serial] = resolve;
-    sendCommand(cmd, serial);
+    sendCommand({ cmd: cmd, serial: serial });
   });
 }
 
 global.r2frida.hostCmd = hostCmd;
+global.r2frida.hostCmds = hostCmds;
 global.r2frida.hostCmdj = hostCmdj;
-global.r2frida.logs = logs;
+global.r2frida.tracelog = tracelog;
+/* plugins read the trace messages as a plain array, oldest first */
+Object.defineProperty(global.r2frida, 'logs', {
+  enumerable: true,
+  get: () => tracelog.messages()
+});
 global.r2frida.log = traceLog;
 global.r2frida.emit = traceEmit;
 global.r2frida.safeio = NeedsSafeIo;
 
 
-function sendCommand (cmd, serial) {
+function sendCommand (stanza) {
   function sendIt () {
     sendingCommand = true;
-    send(wrapStanza('cmd', {
-      cmd: cmd,
-      serial: serial
-    }));
+    send(wrapStanza('cmd', stanza));
   }
 
   if (sendingCommand) {
@@ -4139,14 +4469,14 @@ function sendCommand (cmd, serial) {
 }
 
 function onCmdResp (params) {
-  const { serial, output } = params;
+  const { serial, output, outputs } = params;
 
   sendingCommand = false;
 
   if (serial in pendingCmds) {
     const onFinish = pendingCmds[serial];
     delete pendingCmds[serial];
-    process.nextTick(() => onFinish(output));
+    process.nextTick(() => onFinish((outputs !== undefined) ? outputs : output));
   } else {
     throw new Error('Command response out of sync');
   }
@@ -4170,4 +4500,5 @@ function wrapStanza (name, stanza) {
   };
 }
 
+const agentLoadTime = Date.now() - agentLoadStart;
 recv(onStanza);
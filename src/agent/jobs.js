@@ -0,0 +1,97 @@
+'use strict';
+
+/* commands running in the background, started with \& <cmd> */
+const jobs = new Map();
+let serial = 0;
+
+module.exports = {
+  start,
+  list,
+  take,
+  cancel
+};
+
+/*
+ * the runner starts on the next tick, so the host gets the job id before any work is done.
+ * discard(value) releases what a result holds elsewhere when nobody will fetch it, like a stalker trace in the host
+ */
+function start (command, runner, discard) {
+  const job = {
+    id: ++serial,
+    command: command,
+    discard: discard,
+    status: 'running',
+    started: Date.now(),
+    finished: 0,
+    value: undefined,
+    error: undefined
+  };
+  jobs.set(job.id, job);
+  setTimeout(() => {
+    Promise.resolve()
+      .then(runner)
+      .then((value) => _finish(job, 'done', value))
+      .catch((e) => _finish(job, 'failed', undefined, e));
+  }, 0);
+  return job;
+}
+
+function _finish (job, status, value, error) {
+  if (job.status !== 'running') {
+    if (job.discard && status === 'done') {
+      job.discard(value);
+    }
+    return;
+  }
+  job.status = status;
+  job.finished = Date.now();
+  job.value = value;
+  job.error = error ? error.message : undefined;
+  send({
+    name: 'job-done',
+    stanza: {
+      id: job.id,
+      status: status,
+      command: job.command
+    }
+  });
+}
+
+function list () {
+  const now = Date.now();
+  return Array.from(jobs.values()).map((job) => {
+    return {
+      id: job.id,
+      status: job.status,
+      elapsed: (job.finished || now) - job.started,
+      command: job.command
+    };
+  });
+}
+
+/* finished jobs are forgotten once their result is fetched */
+function take (id) {
+  const job = jobs.get(id);
+  if (job !== undefined && job.status !== 'running') {
+    jobs.delete(id);
+  }
+  return job;
+}
+
+/* there is no way to interrupt agent code, the result of a cancelled job is discarded */
+function cancel (id) {
+  const job = jobs.get(id);
+  if (job === undefined) {
+    return false;
+  }
+  if (job.status === 'running') {
+    job.status = 'cancelled';
+    job.finished = Date.now();
+  } else {
+    if (job.discard && job.status === 'done') {
+      job.discard(job.value);
+    }
+    jobs.delete(id);
+  }
+  return true;
+}
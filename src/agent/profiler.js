@@ -0,0 +1,412 @@
+'use strict';
+
+/* function profiler, onEnter/onLeave are paired natively and aggregated per thread, see \dtp */
+const maxFunctions = 1024;
+const buckets = 32;
+const statsSize = 4 * 8 + buckets * 4;
+const recycleInterval = 1000;
+
+const cSource = `
+#include <gum/guminterceptor.h>
+
+#define R2F_PROF_FUNCS ${maxFunctions}
+#define R2F_PROF_THREADS 256
+#define R2F_PROF_DEPTH 64
+#define R2F_PROF_BUCKETS ${buckets}
+
+typedef struct {
+  guint64 calls;
+  guint64 total;
+  guint64 self;
+  guint64 max;
+  guint32 hist[R2F_PROF_BUCKETS];
+} R2FProfStats;
+
+typedef struct {
+  guint64 start;
+  guint64 child;
+} R2FProfFrame;
+
+typedef struct {
+  volatile gint tid;
+  gint depth;
+  R2FProfFrame frames[R2F_PROF_DEPTH];
+  R2FProfStats * stats;
+} R2FProfThread;
+
+static R2FProfThread threads[R2F_PROF_THREADS];
+/* calls made while every slot was taken, see r2f_prof_release */
+static volatile gint missed = 0;
+
+#ifdef R2F_PROF_CLOCK
+typedef struct {
+  glong tv_sec;
+  glong tv_nsec;
+} R2FTimespec;
+
+extern int clock_gettime (int clk, R2FTimespec * ts);
+
+static guint64 now (void) {
+  R2FTimespec ts;
+  clock_gettime (R2F_PROF_CLOCK, &ts);
+  return (guint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#else
+static guint64 now (void) {
+  return (guint64) g_get_monotonic_time () * 1000;
+}
+#endif
+
+/* each thread claims a slot and is the only writer of its counters until it exits */
+static R2FProfThread * thread_slot (gint tid) {
+  guint i, h = (guint) tid % R2F_PROF_THREADS;
+  for (i = 0; i < R2F_PROF_THREADS; i++) {
+    R2FProfThread * t = &threads[(h + i) % R2F_PROF_THREADS];
+    if (t->tid == tid) {
+      return t;
+    }
+    if (t->tid == 0 && g_atomic_int_compare_and_exchange (&t->tid, 0, tid)) {
+      if (t->stats == NULL) {
+        t->stats = g_malloc0 (R2F_PROF_FUNCS * sizeof (R2FProfStats));
+      }
+      t->depth = 0;
+      return t;
+    }
+  }
+  return NULL;
+}
+
+void onEnter (GumInvocationContext * ic) {
+  R2FProfThread * t = thread_slot (gum_invocation_context_get_thread_id (ic));
+  if (t == NULL) {
+    g_atomic_int_inc (&missed);
+    return;
+  }
+  if (t->depth < R2F_PROF_DEPTH) {
+    t->frames[t->depth].start = now ();
+    t->frames[t->depth].child = 0;
+  }
+  t->depth++;
+}
+
+void onLeave (GumInvocationContext * ic) {
+  R2FProfThread * t = thread_slot (gum_invocation_context_get_thread_id (ic));
+  guint idx = GPOINTER_TO_UINT (gum_invocation_context_get_listener_function_data (ic));
+  R2FProfFrame * f;
+  R2FProfStats * s;
+  guint64 elapsed, v;
+  guint b = 0;
+  if (t == NULL || t->depth == 0) {
+    return;
+  }
+  t->depth--;
+  if (t->depth >= R2F_PROF_DEPTH || idx >= R2F_PROF_FUNCS) {
+    return;
+  }
+  f = &t->frames[t->depth];
+  elapsed = now () - f->start;
+  s = &t->stats[idx];
+  s->calls++;
+  s->total += elapsed;
+  s->self += (elapsed > f->child) ? elapsed - f->child : 0;
+  if (elapsed > s->max) {
+    s->max = elapsed;
+  }
+  for (v = elapsed; v > 1 && b < R2F_PROF_BUCKETS - 1; v >>= 1) {
+    b++;
+  }
+  s->hist[b]++;
+  if (t->depth > 0 && t->depth <= R2F_PROF_DEPTH) {
+    t->frames[t->depth - 1].child += elapsed;
+  }
+}
+
+gint r2f_prof_thread_id (guint i) {
+  return threads[i].tid;
+}
+
+R2FProfStats * r2f_prof_thread_stats (guint i) {
+  return threads[i].stats;
+}
+
+guint r2f_prof_threads (void) {
+  return R2F_PROF_THREADS;
+}
+
+gint r2f_prof_missed (void) {
+  return missed;
+}
+
+static void clear_stats (R2FProfStats * stats) {
+  guint8 * p = (guint8 *) stats;
+  guint j;
+  for (j = 0; j < R2F_PROF_FUNCS * sizeof (R2FProfStats); j++) {
+    p[j] = 0;
+  }
+}
+
+/* only for threads that have exited, the counters must have been read before */
+void r2f_prof_release (guint i) {
+  gint tid = threads[i].tid;
+  if (threads[i].stats != NULL) {
+    clear_stats (threads[i].stats);
+  }
+  threads[i].depth = 0;
+  g_atomic_int_compare_and_exchange (&threads[i].tid, tid, 0);
+}
+
+/* racy against running hooks, counters of in-flight calls may survive */
+void r2f_prof_reset (void) {
+  guint i;
+  for (i = 0; i < R2F_PROF_THREADS; i++) {
+    if (threads[i].stats != NULL) {
+      clear_stats (threads[i].stats);
+    }
+  }
+  missed = 0;
+}
+`;
+
+let cm = null;
+let api = null;
+let recycler = null;
+const functions = [];
+/* counters of exited threads, kept here once their slot is recycled */
+const retired = {};
+/* owner of every slot as seen by the previous _recycle() */
+let owners = null;
+
+module.exports = {
+  add,
+  remove,
+  removeAll,
+  reset,
+  report,
+  missed: () => (api === null) ? 0 : api.missed(),
+  list: () => functions.filter(f => f.listener !== null)
+};
+
+function _init () {
+  if (cm !== null) {
+    return;
+  }
+  const clockGettime = Module.findExportByName(null, 'clock_gettime');
+  let prefix = '';
+  if (clockGettime !== null) {
+    const monotonic = (Process.platform === 'darwin') ? 6 : 1;
+    prefix = `#define R2F_PROF_CLOCK ${monotonic}\n`;
+  }
+  cm = new CModule(prefix + cSource, clockGettime !== null ? { clock_gettime: clockGettime } : {});
+  api = {
+    threadId: new NativeFunction(cm.r2f_prof_thread_id, 'int', ['uint']),
+    threadStats: new NativeFunction(cm.r2f_prof_thread_stats, 'pointer', ['uint']),
+    threads: new NativeFunction(cm.r2f_prof_threads, 'uint', []),
+    missed: new NativeFunction(cm.r2f_prof_missed, 'int', []),
+    release: new NativeFunction(cm.r2f_prof_release, 'void', ['uint']),
+    reset: new NativeFunction(cm.r2f_prof_reset, 'void', [])
+  };
+}
+
+function _readThread (base) {
+  const res = {};
+  functions.forEach((f, index) => {
+    const stats = _readStats(base.add(index * statsSize));
+    if (stats.calls > 0) {
+      res[index] = stats;
+    }
+  });
+  return res;
+}
+
+/*
+ * slots of threads that are gone are handed back, so new threads keep being profiled.
+ * a slot is only released when it had the same owner in the previous pass: that thread
+ * existed before the snapshot taken here, so missing from it means it has exited, while
+ * a thread claiming a slot after the snapshot is left alone until the next pass
+ */
+function _recycle () {
+  const live = new Set(Process.enumerateThreads().map(t => t.id));
+  live.add(Process.getCurrentThreadId());
+  const n = api.threads();
+  const previous = owners;
+  owners = new Int32Array(n);
+  for (let i = 0; i < n; i++) {
+    const tid = api.threadId(i);
+    const base = api.threadStats(i);
+    owners[i] = tid;
+    if (tid === 0 || live.has(tid) || base.isNull() || previous === null || previous[i] !== tid) {
+      continue;
+    }
+    const stats = _readThread(base);
+    for (const index of Object.keys(stats)) {
+      const byThread = retired[index] || (retired[index] = {});
+      if (tid in byThread) {
+        _merge(byThread[tid], stats[index]);
+      } else {
+        byThread[tid] = stats[index];
+      }
+    }
+    api.release(i);
+    owners[i] = 0;
+  }
+}
+
+function add (address, name) {
+  _init();
+  const at = ptr(address);
+  if (functions.some(f => f.listener !== null && f.address.equals(at))) {
+    throw new Error('Already profiling ' + at);
+  }
+  if (functions.length >= maxFunctions) {
+    throw new Error('Cannot profile more than ' + maxFunctions + ' functions, use dtp-* to start over');
+  }
+  const index = functions.length;
+  const listener = Interceptor.attach(at, cm, ptr(index));
+  const entry = { index, address: at, name: name || '', listener };
+  functions.push(entry);
+  if (recycler === null) {
+    recycler = setInterval(_recycle, recycleInterval);
+  }
+  return entry;
+}
+
+/* the counters, those of exited threads included, are kept and reported as detached */
+function remove (address) {
+  const at = ptr(address);
+  for (const f of functions) {
+    if (f.listener !== null && f.address.equals(at)) {
+      f.listener.detach();
+      f.listener = null;
+    }
+  }
+}
+
+/* slots are only reused once every hook is gone, so drop the counters too */
+function removeAll () {
+  for (const f of functions) {
+    if (f.listener !== null) {
+      f.listener.detach();
+    }
+  }
+  functions.splice(0);
+  if (recycler !== null) {
+    clearInterval(recycler);
+    recycler = null;
+  }
+  if (api !== null) {
+    Interceptor.flush();
+    api.reset();
+  }
+  owners = null;
+  _clearRetired();
+}
+
+function reset () {
+  if (api !== null) {
+    api.reset();
+  }
+  _clearRetired();
+}
+
+function _clearRetired () {
+  for (const index of Object.keys(retired)) {
+    delete retired[index];
+  }
+}
+
+function _readStats (base) {
+  const hist = [];
+  for (let b = 0; b < buckets; b++) {
+    hist.push(base.add(32 + b * 4).readU32());
+  }
+  return {
+    calls: base.readU64().toNumber(),
+    total: base.add(8).readU64().toNumber(),
+    self: base.add(16).readU64().toNumber(),
+    max: base.add(24).readU64().toNumber(),
+    hist
+  };
+}
+
+function _merge (into, stats) {
+  into.calls += stats.calls;
+  into.total += stats.total;
+  into.self += stats.self;
+  into.max = Math.max(into.max, stats.max);
+  stats.hist.forEach((n, b) => { into.hist[b] += n; });
+  return into;
+}
+
+/* upper bound in nanoseconds of the log2 bucket holding the given percentile */
+function _percentile (stats, pc) {
+  const wanted = stats.calls * pc / 100;
+  let seen = 0;
+  for (let b = 0; b < buckets; b++) {
+    seen += stats.hist[b];
+    if (seen >= wanted && seen > 0) {
+      return Math.min(stats.max, Math.pow(2, b + 1));
+    }
+  }
+  return stats.max;
+}
+
+function _summary (stats) {
+  return {
+    calls: stats.calls,
+    total: stats.total,
+    self: stats.self,
+    avg: stats.calls ? Math.round(stats.total / stats.calls) : 0,
+    p50: _percentile(stats, 50),
+    p90: _percentile(stats, 90),
+    p99: _percentile(stats, 99),
+    max: stats.max
+  };
+}
+
+function _empty () {
+  return { calls: 0, total: 0, self: 0, max: 0, hist: new Array(buckets).fill(0) };
+}
+
+/* one entry per profiled function with merged totals and a per-thread breakdown, times in ns */
+function report () {
+  if (api === null) {
+    return [];
+  }
+  _recycle();
+  const merged = functions.map(_empty);
+  const perThread = functions.map(() => ({}));
+  const collect = (index, tid, stats) => {
+    const byThread = perThread[index];
+    _merge(merged[index], stats);
+    byThread[tid] = _merge(byThread[tid] || _empty(), stats);
+  };
+  for (const index of Object.keys(retired)) {
+    for (const tid of Object.keys(retired[index])) {
+      collect(index, tid, retired[index][tid]);
+    }
+  }
+  const n = api.threads();
+  for (let i = 0; i < n; i++) {
+    const tid = api.threadId(i);
+    const base = api.threadStats(i);
+    if (tid === 0 || base.isNull()) {
+      continue;
+    }
+    const stats = _readThread(base);
+    for (const index of Object.keys(stats)) {
+      collect(index, tid, stats[index]);
+    }
+  }
+  return functions.map((f, index) => {
+    const threads = {};
+    for (const tid of Object.keys(perThread[index])) {
+      threads[tid] = _summary(perThread[index][tid]);
+    }
+    return Object.assign({
+      address: f.address,
+      name: f.name,
+      active: f.listener !== null,
+      threads
+    }, _summary(merged[index]));
+  });
+}
@@ -0,0 +1,148 @@
+'use strict';
+
+const symcache = require('./symcache');
+
+/* statistical profiler, periodically snapshots the pc (and a shallow stack) of every thread, see \dps */
+const state = {
+  running: false,
+  ticks: 0,
+  samples: 0,
+  elapsed: 0,
+  depth: 0,
+  pcs: new Map(),
+  stacks: new Map()
+};
+
+module.exports = {
+  run,
+  flat,
+  modules,
+  collapsed,
+  clear,
+  stats
+};
+
+function clear () {
+  state.ticks = 0;
+  state.samples = 0;
+  state.elapsed = 0;
+  state.pcs.clear();
+  state.stacks.clear();
+}
+
+/* addresses are kept raw while sampling and only symbolicated when reporting */
+function _sample () {
+  for (const thread of Process.enumerateThreads()) {
+    const pc = thread.context.pc.toString();
+    state.pcs.set(pc, (state.pcs.get(pc) || 0) + 1);
+    if (state.depth > 0) {
+      let frames = [];
+      try {
+        frames = Thread.backtrace(thread.context, Backtracer.FUZZY).slice(0, state.depth);
+      } catch (e) {
+        // unwinding a suspended thread is best effort
+      }
+      const key = [pc].concat(frames.map(String)).join(',');
+      state.stacks.set(key, (state.stacks.get(key) || 0) + 1);
+    }
+    state.samples++;
+  }
+  state.ticks++;
+}
+
+function run (seconds, hz, depth) {
+  if (state.running) {
+    return Promise.reject(new Error('The sampler is already running'));
+  }
+  clear();
+  state.running = true;
+  state.depth = depth;
+  const period = Math.max(1, Math.round(1000 / hz));
+  const start = Date.now();
+  return new Promise((resolve, reject) => {
+    // chained timeouts so slow snapshots delay the next tick instead of piling up
+    (function tick () {
+      let next = false;
+      try {
+        const now = Date.now();
+        if (now - start >= seconds * 1000) {
+          state.elapsed = now - start;
+          resolve(stats());
+          return;
+        }
+        _sample();
+        setTimeout(tick, Math.max(0, period - (Date.now() - now)));
+        next = true;
+      } catch (e) {
+        state.elapsed = Date.now() - start;
+        reject(e);
+      } finally {
+        // a failing tick ends the run too, otherwise every later \dps would be refused
+        if (!next) {
+          state.running = false;
+        }
+      }
+    })();
+  });
+}
+
+function stats () {
+  return {
+    ticks: state.ticks,
+    samples: state.samples,
+    elapsed: state.elapsed,
+    rate: state.elapsed ? Math.round(state.ticks * 1000 / state.elapsed) : 0
+  };
+}
+
+function _label (address) {
+  const sym = symcache.symbolicate(ptr(address));
+  const name = (sym.name === null || sym.name.startsWith('0x')) ? address : sym.name;
+  return (sym.moduleName || '?') + '!' + name;
+}
+
+function _sorted (counts) {
+  return Object.keys(counts)
+    .map((key) => Object.assign({ name: key }, counts[key]))
+    .sort((a, b) => b.self - a.self || b.total - a.total);
+}
+
+/* self counts the samples where the symbol was running, total the ones where it was on the stack */
+function flat () {
+  const counts = {};
+  const entry = (name) => counts[name] || (counts[name] = { self: 0, total: 0 });
+  for (const [pc, n] of state.pcs) {
+    entry(_label(pc)).self += n;
+  }
+  if (state.depth === 0) {
+    Object.keys(counts).forEach((k) => { counts[k].total = counts[k].self; });
+  } else {
+    for (const [key, n] of state.stacks) {
+      const seen = new Set(key.split(',').map(_label));
+      seen.forEach((name) => { entry(name).total += n; });
+    }
+  }
+  return _sorted(counts);
+}
+
+function modules () {
+  const counts = {};
+  for (const [pc, n] of state.pcs) {
+    const name = symcache.symbolicate(ptr(pc)).moduleName || '?';
+    counts[name] = counts[name] || { self: 0, total: 0 };
+    counts[name].self += n;
+    counts[name].total += n;
+  }
+  return _sorted(counts);
+}
+
+/* one "root;..;leaf count" line per distinct stack, as consumed by flamegraph.pl */
+function collapsed () {
+  const lines = {};
+  const source = (state.depth > 0) ? state.stacks : state.pcs;
+  for (const [key, n] of source) {
+    const line = key.split(',').map(_label).reverse().join(';');
+    lines[line] = (lines[line] || 0) + n;
+  }
+  return Object.keys(lines).map((line) => line + ' ' + lines[line]);
+}
@@ -0,0 +1,97 @@
+'use strict';
+
+/* bulk data placed in a memfd ring shared with a local host, only a small stanza goes through send() */
+const headerSize = 4096;
+const minSize = 16384;
+let ring = null;
+const counters = {
+  messages: 0,
+  bytes: 0,
+  full: 0
+};
+
+module.exports = {
+  attach,
+  place,
+  stats
+};
+
+function _libc (name, ret, args) {
+  return new NativeFunction(Module.getExportByName(null, name), ret, args);
+}
+
+/* the host passes its pid and the memfd number, the mapping is reached through /proc */
+function attach (params) {
+  const O_RDWR = 2;
+  const PROT_READ = 1;
+  const PROT_WRITE = 2;
+  const MAP_SHARED = 1;
+  const open = _libc('open', 'int', ['pointer', 'int']);
+  const mmap = _libc('mmap', 'pointer', ['pointer', 'size_t', 'int', 'int', 'int', 'size_t']);
+  const close = _libc('close', 'int', ['int']);
+  const path = '/proc/' + params.pid + '/fd/' + params.fd;
+  const fd = open(Memory.allocUtf8String(path), O_RDWR);
+  if (fd === -1) {
+    throw new Error('Cannot open ' + path);
+  }
+  const base = mmap(NULL, params.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base.equals(ptr('-1'))) {
+    throw new Error('Cannot map ' + path);
+  }
+  ring = {
+    base: base,
+    data: base.add(headerSize),
+    capacity: params.size - headerSize,
+    written: 0
+  };
+  return [{ size: params.size }, null];
+}
+
+/*
+ * positions grow forever, the host stores how far it has consumed in the first 8 bytes of the header.
+ * a payload never wraps, the tail of the ring is skipped instead
+ */
+function _reserve (size) {
+  const consumed = ring.base.readU64().toNumber();
+  let position = ring.written;
+  let offset = position % ring.capacity;
+  if (offset + size > ring.capacity) {
+    position += ring.capacity - offset;
+    offset = 0;
+  }
+  if (position + size - consumed > ring.capacity) {
+    return -1;
+  }
+  ring.written = position + size;
+  return offset;
+}
+
+/* returns false when the data has to be sent the usual way: small, no ring, or no room left */
+function place (message, data) {
+  const size = (data instanceof ArrayBuffer) ? data.byteLength : 0;
+  if (ring === null || size < minSize) {
+    return false;
+  }
+  const offset = _reserve(size);
+  if (offset === -1) {
+    counters.full++;
+    return false;
+  }
+  ring.data.add(offset).writeByteArray(data);
+  counters.messages++;
+  counters.bytes += size;
+  message.shm = { offset: offset, size: size, next: ring.written };
+  send(message);
+  return true;
+}
+
+function stats () {
+  return {
+    shm: ring !== null,
+    'shm.capacity': ring ? ring.capacity : 0,
+    'shm.messages': counters.messages,
+    'shm.bytes': counters.bytes,
+    'shm.full': counters.full
+  };
+}
@@ -1,8 +1,17 @@
 /* eslint-disable comma-dangle */
 'use strict';
 
-const eventsByThread = {};
+const callgraph = require('./callgraph');
+const coverage = require('./coverage');
+const wire = require('./wire');
+
+/* raw GumEvent buffers are sent to the host as they arrive and decoded in io_frida.c */
 const inModules = [];
+let session = 0;
+/* Stalker.exclude() cannot be undone, remember what stalker.exclude has excluded so far */
+const excluded = new Set();
+/* per thread counters of the current session, reported by \dts when it finishes */
+const threadStats = {};
 
 module.exports = {
   stalkFunction: stalkFunction,
@@ -15,8 +24,8 @@ function stalkFunction (config, address) {
     const threads = new Set();
     const completedThreads = new Set();
 
-    _clearEvents();
     _initModules(config);
+    _startSession(config);
 
     const hook = Interceptor.attach(address, {
       onEnter () {
@@ -74,11 +83,6 @@ function stalkFunction (config, address) {
       unfollowAll();
       Stalker.garbageCollect();
 
-      const tids = Object.keys(eventsByThread);
-      tids.forEach((threadId) => {
-        delete eventsByThread[threadId];
-      });
-
       reject(new Error('Stalker timeout reached'));
     }
   });
@@ -86,12 +90,27 @@ function stalkFunction (config, address) {
 
 function stalkEverything (config, timeout) {
   return new Promise((resolve, reject) => {
-    _clearEvents();
     _initModules(config);
+    _startSession(config);
 
-    const threads = Process.enumerateThreadsSync();
-    for (const thread of threads) {
-      _followThread(config, thread.id);
+    const followed = new Set();
+    const followNew = (thread) => {
+      if (!followed.has(thread.id) && _wantThread(config, thread)) {
+        followed.add(thread.id);
+        _followThread(config, thread.id);
+      }
+    };
+    Process.enumerateThreadsSync().forEach(followNew);
+
+    // threads created while stalking are followed too, by observer or by polling
+    let observer = null;
+    let poller = null;
+    if (config.threadsPoll > 0) {
+      if (typeof Process.attachThreadObserver === 'function') {
+        observer = Process.attachThreadObserver({ onAdded: followNew });
+      } else {
+        poller = setInterval(() => Process.enumerateThreadsSync().forEach(followNew), config.threadsPoll);
+      }
     }
 
     let _timeout = timeout || config.timeout;
@@ -100,33 +119,71 @@ function stalkEverything (config, timeout) {
     }
 
     setTimeout(() => {
-      for (const thread of threads) {
-        Stalker.unfollow(thread.id);
+      if (observer !== null) {
+        observer.detach();
+      }
+      if (poller !== null) {
+        clearInterval(poller);
       }
-      _notifyEvents(threads.map((thread) => thread.id), resolve);
+      for (const threadId of followed) {
+        Stalker.unfollow(threadId);
+      }
+      _notifyEvents(Array.from(followed), resolve);
     }, (_timeout >> 0) * 1000);
   });
 }
 
+/* stalker.threads and stalker.threads.exclude hold thread ids or name patterns */
+function _wantThread (config, thread) {
+  const include = _patterns(config.threads);
+  const exclude = _patterns(config.threadsExclude);
+  const match = (patterns) => patterns.some((pattern) => {
+    return pattern === '' + thread.id || (thread.name !== undefined && _globRegExp(pattern).test(thread.name));
+  });
+  if (include.length > 0 && !match(include)) {
+    return false;
+  }
+  return !match(exclude);
+}
+
+/* give the stalker time to deliver the last buffers before the host renders them */
 function _notifyEvents (completedThreads, resolve) {
   Stalker.garbageCollect();
   setTimeout(() => {
-    const result = {};
-    for (const threadId of completedThreads) {
-      if (threadId in eventsByThread) {
-        result[threadId] = eventsByThread[threadId];
-        delete eventsByThread[threadId];
-      }
-    }
-    resolve(result);
+    resolve({
+      session: session,
+      threads: Array.from(completedThreads),
+      stats: Object.assign({}, threadStats)
+    });
   }, 1000);
 }
 
-function _clearEvents () {
-  const threadIds = Object.keys(eventsByThread);
-  for (const threadId of threadIds) {
-    delete eventsByThread[threadId];
+/* the host filters events by these ranges and writes them to the file if any */
+function _startSession (config) {
+  session++;
+  Object.keys(threadStats).forEach((tid) => delete threadStats[tid]);
+  if (config.queueCapacity > 0) {
+    Stalker.queueCapacity = config.queueCapacity;
   }
+  if (config.queueDrain > 0) {
+    Stalker.queueDrainInterval = config.queueDrain;
+  }
+  // these events never reach the host, so they are filtered where they are recorded
+  if (config.event === 'coverage') {
+    coverage.setRanges(inModules);
+  } else if (config.event === 'callgraph') {
+    callgraph.setRanges(inModules);
+  }
+  send({
+    name: 'stalker-start',
+    stanza: {
+      session: session,
+      event: config.event,
+      pointerSize: Process.pointerSize,
+      file: config.file || '',
+      ranges: inModules.map(([start, end]) => [start.toString(), end.toString()])
+    }
+  });
 }
 
 function _followHere (config) {
@@ -138,26 +195,48 @@ function _followHere (config) {
 }
 
 function _followThread (config, threadId) {
+  if (config.event === 'coverage') {
+    Stalker.follow(threadId, {
+      transform: coverage.transform()
+    });
+    return;
+  }
+  if (config.event === 'callgraph') {
+    Stalker.follow(threadId, {
+      events: { call: true },
+      onEvent: callgraph.onEvent()
+    });
+    return;
+  }
   Stalker.follow(threadId, {
     events: _eventsFromConfig(config),
     onReceive: function (events) {
-      const parsed = Stalker
-        .parse(events, { annotate: false })
-        .filter(_filterEvent);
-
-      if (parsed.length === 0) {
-        return;
-      }
-
-      if (threadId in eventsByThread) {
-        eventsByThread[threadId].push(...parsed);
-      } else {
-        eventsByThread[threadId] = parsed;
-      }
+      _countEvents(threadId, events);
+      wire.send({
+        name: 'stalker-events',
+        stanza: {
+          session: session,
+          tid: threadId
+        }
+      }, events);
     }
   });
 }
 
+/* the stalker silently drops events once a thread queue is full, so count the drains that hit the limit */
+function _countEvents (threadId, events) {
+  const count = events.byteLength / (4 * Process.pointerSize);
+  let st = threadStats[threadId];
+  if (st === undefined) {
+    st = threadStats[threadId] = { events: 0, drains: 0, full: 0 };
+  }
+  st.events += count;
+  st.drains++;
+  if (count >= Stalker.queueCapacity) {
+    st.full++;
+  }
+}
+
 function _unfollowHere () {
   Stalker.unfollow();
 }
@@ -183,33 +262,53 @@ function _eventsFromConfig (config) {
   return events;
 }
 
-function _filterEvent (event) {
-  if (inModules.length === 0) {
-    return true;
+/*
+ * only the modules listed in stalker.exclude are excluded from stalking, Stalker.exclude() cannot be undone.
+ * stalker.in and stalker.modules only select the ranges the host keeps events for, so they can change later
+ */
+function _initModules (config) {
+  inModules.splice(0);
+
+  const modules = Process.enumerateModulesSync();
+  const include = _patterns(config.modules);
+  const exclude = _patterns(config.exclude);
+  for (const module of modules) {
+    if (exclude.length > 0 && _matchModule(exclude, module) && !excluded.has(module.path)) {
+      Stalker.exclude({ base: module.base, size: module.size });
+      excluded.add(module.path);
+    }
+  }
+  let wanted = (config.stalkin === 'app') ? modules.slice(0, 1) : modules;
+  if (include.length > 0) {
+    wanted = wanted.filter((module) => _matchModule(include, module));
   }
+  wanted = wanted.filter((module) => !excluded.has(module.path));
+  // anonymous code like JIT regions is not in any module, the host drops its events
+  if (config.stalkin !== 'raw' || include.length > 0) {
+    inModules.push(...wanted.map((module) => {
+      return [module.base, module.base.add(module.size)];
+    }));
+  }
+}
 
-  const address = event[0];
-  return inModules.some(([start, end]) => {
-    return address.compare(start) >= 0 && address.compare(end) <= 0;
+function _patterns (list) {
+  return (list || '').split(',').map((pattern) => pattern.trim()).filter((pattern) => pattern.length > 0);
+}
+
+/* patterns match the module name or path, * is a wildcard */
+function _matchModule (patterns, module) {
+  return patterns.some((pattern) => {
+    const re = _globRegExp(pattern);
+    return re.test(module.name) || re.test(module.path);
   });
 }
 
-function _initModules (config) {
-  inModules.splice(0, -1);
-
-  switch (config.stalkin) {
-    case 'app':
-      const appModule = Process.enumerateModulesSync()[0];
-      inModules.push([appModule.base, appModule.base.add(appModule.size)]);
-      return;
-    case 'modules':
-      inModules.push(...Process.enumerateModulesSync().map((module) => {
-        return [module.base, module.base.add(module.size)];
-      }));
-      break;
-    default:
-      break;
-  }
+function _globRegExp (pattern) {
+  return new RegExp('^' + pattern.split('*').map(_escapeRegExp).join('.*') + '$');
+}
+
+function _escapeRegExp (str) {
+  return str.replace(/[.+?^${}()|[\]\\]/g, '\\$&');
 }
 
 /* globals Interceptor, Stalker */
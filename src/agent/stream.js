@@ -0,0 +1,116 @@
+'use strict';
+
+const config = require('./config');
+const { utf8Encode } = require('./batch');
+const wire = require('./wire');
+
+/* replies streamed as successive 'reply-chunk' messages, acknowledged by the host one by one */
+const window = 4;
+let serial = 0;
+let current = null;
+
+module.exports = {
+  create,
+  fromArray,
+  isStream,
+  send: sendStream,
+  ack
+};
+
+/* pull() returns the next piece of text, or null once there is nothing left */
+function create (pull) {
+  return { r2fStream: true, pull };
+}
+
+function fromArray (items, format) {
+  let i = 0;
+  return create(() => (i < items.length) ? format(items[i++]) : null);
+}
+
+function isStream (value) {
+  return value !== null && typeof value === 'object' && value.r2fStream === true;
+}
+
+/* resolves once every chunk is acknowledged, so at most window chunks are in flight */
+function sendStream (stream) {
+  if (current !== null) {
+    return Promise.reject(new Error('Another reply is being streamed'));
+  }
+  const chunkSize = Math.max(1024, +config.get('reply.chunk') >> 0);
+  const state = {
+    id: ++serial,
+    file: config.getString('reply.file'),
+    chunks: 0,
+    bytes: 0,
+    inflight: 0,
+    done: false,
+    wake: null
+  };
+  current = state;
+  return new Promise((resolve, reject) => {
+    function pump () {
+      try {
+        while (!state.done && state.inflight < window) {
+          const text = _fill(stream, chunkSize, state);
+          if (text.length > 0) {
+            _sendChunk(state, text);
+          }
+        }
+      } catch (e) {
+        current = null;
+        reject(e);
+        return;
+      }
+      if (state.done && state.inflight === 0) {
+        current = null;
+        resolve({ chunks: state.chunks, bytes: state.bytes });
+        return;
+      }
+      state.wake = pump;
+    }
+    pump();
+  });
+}
+
+function _fill (stream, chunkSize, state) {
+  const pieces = [];
+  let length = 0;
+  while (length < chunkSize) {
+    const piece = stream.pull();
+    if (piece === null || piece === undefined) {
+      state.done = true;
+      break;
+    }
+    pieces.push(piece);
+    length += piece.length;
+  }
+  return pieces.join('');
+}
+
+function _sendChunk (state, text) {
+  const bytes = utf8Encode(text);
+  state.chunks++;
+  state.bytes += bytes.length;
+  state.inflight++;
+  wire.send({
+    name: 'reply-chunk',
+    stanza: {
+      stream: state.id,
+      index: state.chunks - 1,
+      file: state.file
+    }
+  }, bytes.buffer);
+}
+
+function ack (params) {
+  const state = current;
+  if (state === null || params.stream !== state.id) {
+    return;
+  }
+  state.inflight--;
+  const wake = state.wake;
+  if (wake !== null) {
+    state.wake = null;
+    wake();
+  }
+}
@@ -0,0 +1,51 @@
+'use strict';
+
+/* address -> DebugSymbol cache shared by the trace and breakpoint hooks */
+const maxEntries = 65536;
+const cache = new Map();
+
+module.exports = {
+  backtrace,
+  symbolicate,
+  symbolicateAll,
+  render,
+  clear
+};
+
+/* only unwind at hit time, symbols are resolved later through symbolicate() */
+function backtrace (context) {
+  return Thread.backtrace(context);
+}
+
+function symbolicate (address) {
+  const key = address.toString();
+  let sym = cache.get(key);
+  if (sym === undefined) {
+    if (cache.size >= maxEntries) {
+      cache.clear();
+    }
+    sym = DebugSymbol.fromAddress(ptr(address));
+    cache.set(key, sym);
+  }
+  return sym;
+}
+
+function symbolicateAll (addresses) {
+  return addresses.map(symbolicate);
+}
+
+/* attach the symbolicated backtrace to a trace message the same way the hooks used to */
+function render (message, addresses) {
+  if (!addresses) {
+    return message;
+  }
+  const bt = symbolicateAll(addresses);
+  if (typeof message === 'string') {
+    return message + ` backtrace: ${bt.toString()}`;
+  }
+  return Object.assign({}, message, { backtrace: bt });
+}
+
+function clear () {
+  cache.clear();
+}
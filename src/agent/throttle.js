@@ -0,0 +1,93 @@
+'use strict';
+
+const config = require('./config');
+
+/* per trace point sampling, token bucket rate limit and auto-disable, see \dto */
+const keys = ['sample', 'rate', 'limit'];
+
+module.exports = {
+  create,
+  update,
+  admit,
+  parseOptions,
+  isDefault,
+  toString
+};
+
+function create (options) {
+  const gate = {
+    sample: Math.max(1, +config.get('hook.sample') >> 0),
+    rate: +config.get('hook.rate') >> 0,
+    limit: +config.get('hook.limit') >> 0,
+    emitted: 0,
+    suppressed: 0,
+    tokens: 0,
+    stamp: 0,
+    disabled: false
+  };
+  update(gate, options);
+  return gate;
+}
+
+function update (gate, options) {
+  for (const k of Object.keys(options || {})) {
+    gate[k] = (k === 'sample') ? Math.max(1, options[k]) : options[k];
+  }
+  gate.tokens = gate.rate;
+  gate.stamp = Date.now();
+  return gate;
+}
+
+/* called on every hit, hits is the 1-based hit counter of the trace point */
+function admit (gate, hits) {
+  if (gate.disabled) {
+    return false;
+  }
+  if (gate.sample > 1 && (hits - 1) % gate.sample !== 0) {
+    gate.suppressed++;
+    return false;
+  }
+  if (gate.rate > 0) {
+    const now = Date.now();
+    gate.tokens = Math.min(gate.rate, gate.tokens + (now - gate.stamp) * gate.rate / 1000);
+    gate.stamp = now;
+    if (gate.tokens < 1) {
+      gate.suppressed++;
+      return false;
+    }
+    gate.tokens--;
+  }
+  gate.emitted++;
+  if (gate.limit > 0 && gate.emitted >= gate.limit) {
+    gate.disabled = true;
+  }
+  return true;
+}
+
+/* split sample=N rate=N limit=N tokens from the rest of the command arguments */
+function parseOptions (args) {
+  const options = {};
+  const rest = [];
+  for (const arg of args) {
+    const [k, v] = arg.split('=');
+    if (v === undefined || !keys.includes(k)) {
+      rest.push(arg);
+      continue;
+    }
+    const n = +v;
+    if (isNaN(n) || n < 0) {
+      throw new Error('Invalid number in ' + arg);
+    }
+    options[k] = n >> 0;
+  }
+  return { options, args: rest };
+}
+
+function isDefault (gate) {
+  return gate.sample === 1 && gate.rate === 0 && gate.limit === 0 && !gate.disabled;
+}
+
+function toString (gate) {
+  const res = keys.map(k => k + '=' + gate[k]).join(' ');
+  return gate.disabled ? res + ' disabled' : res;
+}
@@ -0,0 +1,276 @@
+'use strict';
+
+const config = require('./config');
+const symcache = require('./symcache');
+
+const maxShapes = 4096;
+const shapeKeys = ['source', 'name', 'address', 'timestamp', 'values', 'retval'];
+
+/*
+ * fixed-capacity ring of trace records, see hook.logs.size and hook.logs.policy.
+ * hook messages are not kept as objects or formatted lines: their constant part (source,
+ * name and address of the hook, and whether it is shown as text) is interned once as a
+ * shape and only the values and retval of the hit are stored, the timestamp comes from
+ * the timestamps column. text is only formatted when the log is read
+ */
+const store = {
+  capacity: 0,
+  head: 0,
+  length: 0,
+  total: 0,
+  dropped: 0,
+  overwritten: 0,
+  traceIds: new Int32Array(0),
+  threadIds: new Uint32Array(0),
+  timestamps: new Float64Array(0),
+  shapeIds: new Int32Array(0),
+  payloads: [],
+  retvals: [],
+  backtraces: []
+};
+const shapes = [];
+const shapeIndex = new Map();
+/* rendered messages of the whole ring, kept until the next append or clear */
+let cachedMessages = null;
+
+module.exports = {
+  append,
+  clear,
+  records,
+  messages,
+  text,
+  stats,
+  parseFilter
+};
+
+function _ensureCapacity () {
+  const wanted = Math.max(1, +config.get('hook.logs.size') >> 0);
+  if (wanted === store.capacity) {
+    return;
+  }
+  const keep = _slots().slice(-wanted);
+  cachedMessages = null;
+  const traceIds = new Int32Array(wanted);
+  const threadIds = new Uint32Array(wanted);
+  const timestamps = new Float64Array(wanted);
+  const shapeIds = new Int32Array(wanted);
+  const payloads = new Array(wanted);
+  const retvals = new Array(wanted);
+  const backtraces = new Array(wanted);
+  keep.forEach((slot, i) => {
+    traceIds[i] = store.traceIds[slot];
+    threadIds[i] = store.threadIds[slot];
+    timestamps[i] = store.timestamps[slot];
+    shapeIds[i] = store.shapeIds[slot];
+    payloads[i] = store.payloads[slot];
+    retvals[i] = store.retvals[slot];
+    backtraces[i] = store.backtraces[slot];
+  });
+  store.overwritten += store.length - keep.length;
+  store.capacity = wanted;
+  store.length = keep.length;
+  store.head = keep.length % wanted;
+  store.traceIds = traceIds;
+  store.threadIds = threadIds;
+  store.timestamps = timestamps;
+  store.shapeIds = shapeIds;
+  store.payloads = payloads;
+  store.retvals = retvals;
+  store.backtraces = backtraces;
+}
+
+/* index of the interned constant part of a hook message, -1 when it has to be kept as is */
+function _shape (message, asText) {
+  if (typeof message !== 'object' || message === null || typeof message.source !== 'string' ||
+      !(message.timestamp instanceof Date) || !Object.keys(message).every(k => shapeKeys.includes(k))) {
+    return -1;
+  }
+  const hasName = 'name' in message;
+  const hasRetval = 'retval' in message;
+  const key = [message.source, message.name, message.address, hasName, hasRetval, asText].join('\0');
+  let id = shapeIndex.get(key);
+  if (id === undefined) {
+    if (shapes.length >= maxShapes) {
+      return -1;
+    }
+    id = shapes.length;
+    shapes.push({ source: message.source, name: message.name, address: message.address, hasName, hasRetval, asText });
+    shapeIndex.set(key, id);
+  }
+  return id;
+}
+
+/* the hook.output=simple line of a hook message */
+function text (message) {
+  const ts = message.timestamp;
+  switch (message.source) {
+    case 'dtf':
+      if ('retval' in message) {
+        return `[dtf onLeave][${ts}] ${message.name}@${message.address} - args: ${message.values.join(', ')}. Retval: ${message.retval.toString()}`;
+      }
+      return `[dtf onEnter][${ts}] ${message.name}@${message.address} - args: ${message.values.join(', ')}`;
+    case 'dtr':
+      return `[dtr][${ts}] ${message.address} - registers: ${JSON.stringify(message.values)}`;
+    case 'dt':
+      return `[dt][${ts}] ${message.address} - args: ${JSON.stringify(message.values)}`;
+  }
+  return JSON.stringify(message);
+}
+
+/* rebuilds the message as it was appended, with the same key order */
+function _message (slot) {
+  const id = store.shapeIds[slot];
+  if (id < 0) {
+    return store.payloads[slot];
+  }
+  const shape = shapes[id];
+  const message = { source: shape.source };
+  if (shape.hasName) {
+    message.name = shape.name;
+  }
+  message.address = shape.address;
+  message.timestamp = new Date(store.timestamps[slot]);
+  message.values = store.payloads[slot];
+  if (shape.hasRetval) {
+    message.retval = store.retvals[slot];
+  }
+  return shape.asText ? text(message) : message;
+}
+
+/* physical slot indexes from oldest to newest */
+function _slots () {
+  const res = [];
+  const first = (store.head - store.length + store.capacity) % (store.capacity || 1);
+  for (let i = 0; i < store.length; i++) {
+    res.push((first + i) % store.capacity);
+  }
+  return res;
+}
+
+/* backtrace holds raw return addresses, they are symbolicated when dumped. asText keeps the
+ * hook message structured but reads it back as its hook.output=simple line */
+function append (message, traceId, threadId, backtrace, asText) {
+  _ensureCapacity();
+  if (store.length === store.capacity) {
+    if (config.getString('hook.logs.policy') === 'stop') {
+      store.dropped++;
+      return false;
+    }
+    store.overwritten++;
+  } else {
+    store.length++;
+  }
+  const slot = store.head;
+  const shape = _shape(message, asText === true);
+  if (shape < 0 && asText === true) {
+    message = text(message);
+  }
+  cachedMessages = null;
+  store.traceIds[slot] = (traceId === undefined) ? -1 : traceId;
+  store.threadIds[slot] = threadId || 0;
+  store.timestamps[slot] = (shape < 0) ? Date.now() : message.timestamp.getTime();
+  store.shapeIds[slot] = shape;
+  store.payloads[slot] = (shape < 0) ? message : message.values;
+  store.retvals[slot] = (shape < 0) ? undefined : message.retval;
+  store.backtraces[slot] = backtrace;
+  store.head = (slot + 1) % store.capacity;
+  store.total++;
+  return true;
+}
+
+function clear () {
+  cachedMessages = null;
+  store.payloads = new Array(store.capacity);
+  store.retvals = new Array(store.capacity);
+  store.backtraces = new Array(store.capacity);
+  store.head = 0;
+  store.length = 0;
+  shapes.splice(0);
+  shapeIndex.clear();
+}
+
+function _matches (filter, slot) {
+  if (filter.trace !== undefined && store.traceIds[slot] !== filter.trace) {
+    return false;
+  }
+  if (filter.tid !== undefined && store.threadIds[slot] !== filter.tid) {
+    return false;
+  }
+  if (filter.from !== undefined && store.timestamps[slot] < filter.from) {
+    return false;
+  }
+  if (filter.to !== undefined && store.timestamps[slot] > filter.to) {
+    return false;
+  }
+  return true;
+}
+
+/* oldest first, filtered by trace id, thread and time window, then paged */
+function records (filter) {
+  _ensureCapacity();
+  const f = filter || {};
+  const offset = f.offset || 0;
+  const count = (f.count === undefined) ? Infinity : f.count;
+  const res = [];
+  let skipped = 0;
+  for (const slot of _slots()) {
+    if (res.length >= count) {
+      break;
+    }
+    if (!_matches(f, slot)) {
+      continue;
+    }
+    if (skipped++ < offset) {
+      continue;
+    }
+    res.push({
+      trace: store.traceIds[slot],
+      tid: store.threadIds[slot],
+      timestamp: store.timestamps[slot],
+      message: symcache.render(_message(slot), store.backtraces[slot])
+    });
+  }
+  return res;
+}
+
+/* every stored message oldest first, the same array until the log changes */
+function messages () {
+  if (cachedMessages === null) {
+    cachedMessages = records().map(_ => _.message);
+  }
+  return cachedMessages;
+}
+
+function stats () {
+  _ensureCapacity();
+  return {
+    capacity: store.capacity,
+    length: store.length,
+    total: store.total,
+    dropped: store.dropped,
+    overwritten: store.overwritten,
+    shapes: shapes.length,
+    policy: config.getString('hook.logs.policy')
+  };
+}
+
+/* trace=N tid=N from=MS to=MS offset=N count=N, negative times are relative to now */
+function parseFilter (args) {
+  const filter = {};
+  const now = Date.now();
+  for (const arg of args) {
+    const [k, v] = arg.split('=');
+    if (v === undefined || !['trace', 'tid', 'from', 'to', 'offset', 'count'].includes(k)) {
+      throw new Error('Invalid filter ' + arg + ', use trace=, tid=, from=, to=, offset= or count=');
+    }
+    let n = +v;
+    if (isNaN(n)) {
+      throw new Error('Invalid number in ' + arg);
+    }
+    if ((k === 'from' || k === 'to') && n < 0) {
+      n += now;
+    }
+    filter[k] = n;
+  }
+  return filter;
+}
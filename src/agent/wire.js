@@ -0,0 +1,198 @@
+'use strict';
+
+const config = require('./config');
+const shm = require('./shm');
+
+/* larger data is sent as is, the host refuses to unpack more than R2F_WIRE_MAX_UNPACKED */
+const maxPacked = 256 * 1024 * 1024;
+
+/* lz4 block compression of message data, only used once the host has announced it can decode it */
+const cSource = `
+#include <glib.h>
+
+#define R2F_LZ4_HASH_LOG 12
+#define R2F_LZ4_MAX_OFFSET 65535
+
+static guint32 table[1 << R2F_LZ4_HASH_LOG];
+
+static guint32 read32 (const guint8 * p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static guint8 * put_length (guint8 * op, guint n) {
+  while (n >= 255) {
+    *op++ = 255;
+    n -= 255;
+  }
+  *op++ = (guint8) n;
+  return op;
+}
+
+static guint8 * put_literals (guint8 * op, const guint8 * src, guint n) {
+  guint8 * token = op++;
+  guint i;
+  if (n >= 15) {
+    *token = 15 << 4;
+    op = put_length (op, n - 15);
+  } else {
+    *token = (guint8) (n << 4);
+  }
+  for (i = 0; i < n; i++) {
+    *op++ = src[i];
+  }
+  return op;
+}
+
+static guint compress_block (const guint8 * src, guint len, guint8 * dst, guint cap) {
+  guint8 * op = dst;
+  guint8 * oend = dst + cap;
+  guint ip = 0, anchor = 0, i;
+  guint limit = (len > 12) ? len - 12 : 0;
+  for (i = 0; i < (1 << R2F_LZ4_HASH_LOG); i++) {
+    table[i] = 0;
+  }
+  while (ip < limit) {
+    guint32 seq = read32 (src + ip);
+    guint h = (seq * 2654435761U) >> (32 - R2F_LZ4_HASH_LOG);
+    guint ref = table[h];
+    guint mlen = 4;
+    guint8 * token;
+    table[h] = ip + 1;
+    if (ref == 0 || ip - (ref - 1) > R2F_LZ4_MAX_OFFSET || read32 (src + ref - 1) != seq) {
+      ip++;
+      continue;
+    }
+    ref--;
+    while (ip + mlen < len - 5 && src[ref + mlen] == src[ip + mlen]) {
+      mlen++;
+    }
+    if (op + (ip - anchor) + (ip - anchor) / 255 + 16 > oend) {
+      return 0;
+    }
+    token = op;
+    op = put_literals (op, src + anchor, ip - anchor);
+    *op++ = (guint8) ((ip - ref) & 0xff);
+    *op++ = (guint8) ((ip - ref) >> 8);
+    if (mlen - 4 >= 15) {
+      *token |= 15;
+      op = put_length (op, mlen - 4 - 15);
+    } else {
+      *token |= (guint8) (mlen - 4);
+    }
+    ip += mlen;
+    anchor = ip;
+  }
+  if (op + (len - anchor) + (len - anchor) / 255 + 16 > oend) {
+    return 0;
+  }
+  op = put_literals (op, src + anchor, len - anchor);
+  return (op - dst < len) ? (guint) (op - dst) : 0;
+}
+
+/* returns the compressed size, or 0 when the output would not be smaller than the input */
+guint r2f_lz4_compress (const guint8 * src, guint len, guint8 * dst, guint cap, guint64 * usec) {
+  gint64 start = g_get_monotonic_time ();
+  guint n = compress_block (src, len, dst, cap);
+  *usec += g_get_monotonic_time () - start;
+  return n;
+}
+`;
+
+const codecs = ['lz4'];
+let cm = null;
+let api = null;
+let host = { codecs: [], remote: false };
+const counters = {
+  messages: 0,
+  packed: 0,
+  raw: 0,
+  compressed: 0,
+  skipped: 0,
+  usec: null
+};
+
+module.exports = {
+  negotiate,
+  send: sendMessage,
+  codec,
+  stats
+};
+
+function _init () {
+  if (cm !== null) {
+    return api !== null;
+  }
+  try {
+    cm = new CModule(cSource);
+    api = {
+      compress: new NativeFunction(cm.r2f_lz4_compress, 'uint', ['pointer', 'uint', 'pointer', 'uint', 'pointer'])
+    };
+    counters.usec = Memory.alloc(8);
+  } catch (e) {
+    cm = {};
+    console.error('Compression disabled: ' + e.message);
+  }
+  return api !== null;
+}
+
+/* the host lists the codecs it can decode and whether the device is reached over usb or the network, the runtime version keys its bytecode cache */
+function negotiate (params) {
+  host = {
+    codecs: (params.codecs || []).filter(c => codecs.indexOf(c) !== -1),
+    remote: params.remote === true
+  };
+  return [{ codecs: host.codecs, runtime: Frida.version }, null];
+}
+
+function codec () {
+  const mode = config.getString('io.compress');
+  if (mode === 'none' || host.codecs.indexOf('lz4') === -1) {
+    return 'none';
+  }
+  return (mode === 'lz4' || host.remote) ? 'lz4' : 'none';
+}
+
+/* drop-in for send(), data goes through the shared ring when there is one, else is compressed when large enough and worth it */
+function sendMessage (message, data) {
+  if (shm.place(message, data)) {
+    return;
+  }
+  const size = (data instanceof ArrayBuffer) ? data.byteLength : 0;
+  if (size === 0 || size < +config.get('io.compress.min') || size > maxPacked || codec() === 'none' || !_init()) {
+    send(message, data);
+    return;
+  }
+  counters.messages++;
+  counters.raw += size;
+  const src = Memory.alloc(size);
+  src.writeByteArray(data);
+  const cap = size + (size / 255 >>> 0) + 16;
+  const dst = Memory.alloc(cap);
+  const packed = api.compress(src, size, dst, cap, counters.usec);
+  if (packed === 0) {
+    counters.skipped++;
+    counters.compressed += size;
+    send(message, data);
+    return;
+  }
+  counters.packed++;
+  counters.compressed += packed;
+  message.codec = 'lz4';
+  message.size = size;
+  send(message, dst.readByteArray(packed));
+}
+
+function stats () {
+  return Object.assign({
+    codec: codec(),
+    host: host.codecs,
+    remote: host.remote,
+    messages: counters.messages,
+    packed: counters.packed,
+    skipped: counters.skipped,
+    raw: counters.raw,
+    compressed: counters.compressed,
+    ratio: counters.raw ? +(counters.compressed / counters.raw).toFixed(3) : 1,
+    usec: (counters.usec !== null) ? counters.usec.readU64().toNumber() : 0
+  }, shm.stats());
+}
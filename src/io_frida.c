@@ -1,11 +1,20 @@
 /* radare2 - MIT - Copyright 2016-2020 - pancake, oleavr, mrmacete */
 
+#if __linux__ && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // process_vm_readv
+#endif
 #include <r_core.h>
 #include <r_io.h>
 #include <r_lib.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#if __linux__
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 #include "frida-core.h"
 #include "../config.h"
 
@@ -13,10 +22,135 @@
 
 typedef struct {
 	const char * cmd_string;
+	JsonArray * cmds; // batch sent by hostCmds, answered with one output per command
 	ut64 serial;
 	JsonObject * _cmd_json;
 } RFPendingCmd;
 
+// compressed message data received from the agent, see src/agent/wire.js
+typedef struct {
+	ut64 messages;
+	ut64 packed;
+	ut64 unpacked;
+	gint64 usec;
+} RFWireStats;
+
+// phases of the open and attach are printed when R2FRIDA_TIMINGS is set
+typedef struct {
+	bool enabled;
+	gint64 start;
+	gint64 last;
+} RFTimings;
+
+// a piece of a streamed reply, acknowledged once written, see src/agent/stream.js
+typedef struct {
+	gint64 stream;
+	char *file;
+	GBytes *data;
+} RFReplyChunk;
+
+typedef enum {
+	RF_BATCH_LOG = 0,
+	RF_BATCH_LOG_FILE,
+} RFBatchKind;
+
+typedef struct {
+	char *filename;
+	FILE *fd;
+	GString *buf;
+	gint64 last_flush;
+	ut64 size;
+	// tunables sent by the agent with every batch, see file.log.* vars
+	gint64 flush_interval;
+	gsize buffer_size;
+	ut64 rotate_size;
+} RFLogWriter;
+
+// the file.log writers, shared with the flush timer which can run once more after rf is gone
+typedef struct {
+	gint refs;
+	GMutex lock;
+	GHashTable *writers;
+	GSource *timer; // flushes the writers idle for longer than file.log.flush
+} RFLogs;
+
+#define R2F_LOG_ROTATE_KEEP 3
+#define R2F_LOG_TICK_MS 100
+
+// GumEventType values, see gum/gumevent.h
+#define R2F_GUM_CALL (1 << 0)
+#define R2F_GUM_RET (1 << 1)
+#define R2F_GUM_EXEC (1 << 2)
+#define R2F_GUM_BLOCK (1 << 3)
+#define R2F_GUM_COMPILE (1 << 4)
+
+typedef struct {
+	ut32 type;
+	st32 depth;
+	ut64 a; // location or block start
+	ut64 b; // call target or block end
+} RFStalkerEvent;
+
+typedef struct {
+	gint64 session;
+	int pointer_size;
+	char *event;
+	char *file;
+	GArray *ranges; // start, end pairs, empty means everywhere
+	GHashTable *threads; // tid -> GArray of RFStalkerEvent
+	ut64 received;
+	ut64 filtered;
+	ut64 kept;
+	ut64 dropped; // over R2F_STALKER_MAX_EVENTS, only a stalker.file has no limit
+} RFStalkerTrace;
+
+#define R2F_STALKER_MAX_EVENTS (1 << 21)
+
+typedef enum {
+	RF_PROBE_DEVICES = 0,
+	RF_PROBE_APPS,
+	RF_PROBE_PROCS,
+	RF_PROBE_RESOLVE,
+} RFProbeKind;
+
+// a blocking device query run in its own thread, given up on after R2FRIDA_PROBE_TIMEOUT ms
+typedef struct {
+	RFProbeKind kind;
+	FridaDeviceManager *manager; // own reference, the global one can be closed while a probe is abandoned
+	FridaDevice *device; // the result for RF_PROBE_RESOLVE
+	char *device_id;
+	GCancellable *cancellable;
+	GCancellable *parent; // the caller's, cancelling it cancels the probe too
+	gulong parent_handler;
+	GString *out;
+	char *error;
+	int count;
+	bool done;
+	bool cancelled;
+	bool abandoned; // timed out, the thread frees it when the query returns
+} RFProbe;
+
+// memory of local linux targets read and written by the host, see R2FRIDA_DIRECT_IO
+typedef struct {
+	bool enabled;
+	GArray *ranges; // start, end pairs of the readable mappings in /proc/pid/maps
+	gint64 loaded;
+	ut64 reads;
+	ut64 writes;
+	ut64 fallbacks;
+} RFDirectIO;
+
+// memfd ring the agent of a local target writes bulk data to, see R2FRIDA_SHM and src/agent/shm.js
+typedef struct {
+	int fd;
+	ut8 *base; // the first 8 bytes hold how far the host has consumed, data starts at R2F_SHM_HEADER
+	size_t size;
+	ut64 messages;
+	ut64 bytes;
+} RFShm;
+
+#define R2F_SHM_HEADER 4096
+
 typedef struct {
 	char *device_id;
 	char *process_specifier;
@@ -24,6 +158,7 @@ typedef struct {
 	bool pid_valid;
 	bool spawn;
 	bool run;
+	GArray *pids; // more targets when attaching to several processes, see resolve_pids
 } R2FridaLaunchOptions;
 
 typedef struct {
@@ -44,8 +179,19 @@ typedef struct {
 	GBytes *reply_bytes;
 	RCore *r2core;
 	RFPendingCmd * pending_cmd;
+	GQueue reply_chunks;
+	RFWireStats wire;
+	GString *capture; // streamed replies are collected here instead of printed while fanning out
+	GPtrArray *peers; // sessions in other processes of the same device, see \*
+	RFDirectIO direct;
+	RFShm shm;
+	int refs; // descriptors sharing this session, see R2FRIDA_REUSE
 	char *crash_report;
 	RIO *io;
+	gint64 batch_dropped;
+	RFLogs *logs;
+	GMutex stalker_lock;
+	GHashTable *stalker_traces; // session -> RFStalkerTrace, kept until the reply of its command is rendered
 } RIOFrida;
 
 #define RIOFRIDA_DEV(x) (((RIOFrida*)x->data)->device)
@@ -55,14 +201,32 @@ static FridaDevice *get_device_manager(FridaDeviceManager *manager, const char *
 static bool resolve_target(const char *pathname, R2FridaLaunchOptions *lo, GCancellable *cancellable);
 static bool resolve_device(FridaDeviceManager *manager, const char *device_id, FridaDevice **device, GCancellable *cancellable);
 static bool resolve_process(FridaDevice *device, R2FridaLaunchOptions *lo, GCancellable *cancellable);
+static GArray *resolve_pids(FridaDevice *device, const char *spec, GCancellable *cancellable);
 static JsonBuilder *build_request(const char *type);
+static void request_add_state(RIOFrida *rf, JsonBuilder *builder);
 static JsonObject *perform_request(RIOFrida *rf, JsonBuilder *builder, GBytes *data, GBytes **bytes);
+static bool request_post(RIOFrida *rf, JsonBuilder *builder, GBytes *data);
+static JsonObject *request_wait(RIOFrida *rf, GBytes **bytes);
 static RFPendingCmd * pending_cmd_create(JsonObject * cmd_json);
 static void pending_cmd_free(RFPendingCmd * pending_cmd);
 static void perform_request_unlocked(RIOFrida *rf, JsonBuilder *builder, GBytes *data, GBytes **bytes);
 static void exec_pending_cmd_if_needed(RIOFrida * rf);
+static void reply_chunks_flush(RIOFrida *rf);
+static void reply_chunk_free(RFReplyChunk *chunk);
 static char *__system(RIO *io, RIODesc *fd, const char *command);
 static int atopid(const char *maybe_pid, bool *valid);
+static void log_writers_flush(RIOFrida *rf, bool force);
+static bool user_wants_bytecode(void);
+static void bytecode_runtime_save(RIOFrida *rf, const char *runtime);
+static gboolean log_writers_tick(gpointer user_data);
+static void log_writers_free(RIOFrida *rf);
+static RFLogs *logs_new(void);
+static void log_file_append(RIOFrida *rf, JsonObject *stanza, const char *filename, const char *data, gsize len);
+static void stalker_trace_free(RFStalkerTrace *st);
+static void direct_io_init(RIOFrida *rf);
+static void direct_io_fini(RIOFrida *rf);
+static void shm_fini(RIOFrida *rf);
+static void stalker_render(RIOFrida *rf, JsonObject *done);
 
 // event handlers
 static void on_message(FridaScript *script, const char *message, GBytes *data, gpointer user_data);
@@ -71,6 +235,11 @@ static void on_detached(FridaSession *session, FridaSessionDetachReason reason,
 static void dumpDevices(GCancellable *cancellable);
 static void dumpProcesses(FridaDevice *device, GCancellable *cancellable);
 static int dumpApplications(FridaDevice *device, GCancellable *cancellable);
+static void dumpApplicationsOrProcesses(FridaDevice *device, GCancellable *cancellable);
+static RFProbe *probe_new(RFProbeKind kind, FridaDeviceManager *manager, FridaDevice *device, const char *device_id, GCancellable *parent);
+static void probe_free(RFProbe *p);
+static void probe_run(RFProbe **probes, int n);
+static int probe_print(RFProbe *p);
 static gint compareDevices(gconstpointer element_a, gconstpointer element_b);
 static gint compareProcesses(gconstpointer element_a, gconstpointer element_b);
 static gint computeDeviceScore(FridaDevice *device);
@@ -79,6 +248,11 @@ static gint computeProcessScore(FridaProcess *process);
 extern RIOPlugin r_io_plugin_frida;
 static FridaDeviceManager *device_manager = NULL;
 static size_t device_manager_count = 0;
+static GMutex probe_lock;
+static GCond probe_cond;
+// with R2FRIDA_REUSE the last session outlives its descriptors, the next __open of the same uri shares it
+static RIOFrida *reused_session = NULL;
+static char *reused_uri = NULL;
 
 #define src__agent__js r_io_frida_agent_code
 
@@ -138,6 +312,8 @@ static RIOFrida *r_io_frida_new(RIO *io) {
 		return NULL;
 	}
 	rf->suspended = false;
+	rf->refs = 1;
+	rf->logs = logs_new ();
 
 	return rf;
 }
@@ -155,6 +331,125 @@ static bool __request_safe_io(RIOFrida *rf) {
 	return true;
 }
 
+static bool user_wants_compression(void) {
+	bool do_want = true;
+	char *env = r_sys_getenv ("R2FRIDA_COMPRESS");
+	if (env) {
+		if (!strcmp (env, "0") || !strcmp (env, "none")) {
+			do_want = false;
+		}
+		free (env);
+	}
+	return do_want;
+}
+
+// tell the agent which codecs we can decode, it decides per message whether to use them
+static bool __request_compression(RIOFrida *rf) {
+	JsonBuilder *builder = build_request ("compression");
+	json_builder_set_member_name (builder, "codecs");
+	json_builder_begin_array (builder);
+	if (user_wants_compression ()) {
+		json_builder_add_string_value (builder, "lz4");
+	}
+	json_builder_end_array (builder);
+	json_builder_set_member_name (builder, "remote");
+	json_builder_add_boolean_value (builder, frida_device_get_dtype (rf->device) != FRIDA_DEVICE_TYPE_LOCAL);
+
+	JsonObject *result = perform_request (rf, builder, NULL, NULL);
+	if (!result) {
+		return false;
+	}
+	const char *runtime = json_object_has_member (result, "runtime")
+		? json_object_get_string_member (result, "runtime"): NULL;
+	if (R_STR_ISNOTEMPTY (runtime) && user_wants_bytecode ()) {
+		bytecode_runtime_save (rf, runtime);
+	}
+
+	json_object_unref (result);
+
+	return true;
+}
+
+#define R2F_SHM_MAX_MB 4096
+
+/* megabytes of the shared ring from R2FRIDA_SHM, 0 when disabled */
+static size_t user_wants_shm(void) {
+	int mb = 0;
+	char *env = r_sys_getenv ("R2FRIDA_SHM");
+	if (env) {
+		mb = atoi (env);
+		if (mb == 1) {
+			mb = 64;
+		}
+		if (mb < 0 || mb > R2F_SHM_MAX_MB) {
+			eprintf ("R2FRIDA_SHM must be between 1 and %d megabytes\n", R2F_SHM_MAX_MB);
+			mb = 0;
+		}
+		free (env);
+	}
+	return (size_t)mb << 20;
+}
+
+static void shm_fini(RIOFrida *rf) {
+#if __linux__
+	if (rf->shm.base) {
+		munmap (rf->shm.base, rf->shm.size);
+		rf->shm.base = NULL;
+	}
+	if (rf->shm.size) {
+		close (rf->shm.fd);
+		rf->shm.size = 0;
+	}
+#endif
+}
+
+// the agent maps our memfd through /proc/<our pid>/fd, which only works on the same machine
+static bool __request_shm(RIOFrida *rf) {
+#if __linux__
+	const size_t size = user_wants_shm ();
+	if (!size || frida_device_get_dtype (rf->device) != FRIDA_DEVICE_TYPE_LOCAL) {
+		return false;
+	}
+	rf->shm.fd = memfd_create ("r2frida-ring", MFD_CLOEXEC);
+	if (rf->shm.fd == -1) {
+		eprintf ("Cannot create the shared ring: %s\n", strerror (errno));
+		return false;
+	}
+	rf->shm.size = size;
+	if (ftruncate (rf->shm.fd, size) == -1) {
+		eprintf ("Cannot create the shared ring: %s\n", strerror (errno));
+		shm_fini (rf);
+		return false;
+	}
+	rf->shm.base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, rf->shm.fd, 0);
+	if (rf->shm.base == MAP_FAILED) {
+		rf->shm.base = NULL;
+		eprintf ("Cannot map the shared ring: %s\n", strerror (errno));
+		shm_fini (rf);
+		return false;
+	}
+	JsonBuilder *builder = build_request ("shm");
+	json_builder_set_member_name (builder, "pid");
+	json_builder_add_int_value (builder, getpid ());
+	json_builder_set_member_name (builder, "fd");
+	json_builder_add_int_value (builder, rf->shm.fd);
+	json_builder_set_member_name (builder, "size");
+	json_builder_add_int_value (builder, size);
+
+	JsonObject *result = perform_request (rf, builder, NULL, NULL);
+	if (!result) {
+		shm_fini (rf);
+		return false;
+	}
+
+	json_object_unref (result);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
 static R2FridaLaunchOptions *r2frida_launchopt_new (const char *pathname) {
 	R2FridaLaunchOptions *lo = R_NEW0(R2FridaLaunchOptions);
 	if (lo) {
@@ -166,13 +461,45 @@ static R2FridaLaunchOptions *r2frida_launchopt_new (const char *pathname) {
 static void r2frida_launchopt_free(R2FridaLaunchOptions *lo) {
 	g_free (lo->device_id);
 	g_free (lo->process_specifier);
+	if (lo->pids) {
+		g_array_free (lo->pids, TRUE);
+		lo->pids = NULL;
+	}
+}
+
+/* the signal handlers get rf as user data, so they are gone before it is freed */
+static void session_detach(RIOFrida *rf) {
+	const bool attached = !rf->detach_reason;
+	if (rf->script) {
+		g_signal_handlers_disconnect_by_data (rf->script, rf);
+		if (attached) {
+			frida_script_unload_sync (rf->script, NULL, NULL);
+		}
+	}
+	if (rf->session) {
+		g_signal_handlers_disconnect_by_data (rf->session, rf);
+		if (attached) {
+			frida_session_detach_sync (rf->session, NULL, NULL);
+		}
+	}
 }
 
 static void r_io_frida_free(RIOFrida *rf) {
 	if (!rf) {
 		return;
 	}
+	session_detach (rf);
 
+	if (rf->peers) {
+		g_ptr_array_free (rf->peers, TRUE);
+	}
+	log_writers_free (rf);
+	g_queue_clear_full (&rf->reply_chunks, (GDestroyNotify)reply_chunk_free);
+	if (rf->stalker_traces) {
+		g_hash_table_unref (rf->stalker_traces);
+	}
+	direct_io_fini (rf);
+	shm_fini (rf);
 	free (rf->crash_report);
 	g_clear_object (&rf->crash);
 	g_clear_object (&rf->script);
@@ -211,6 +538,8 @@ static RFPendingCmd * pending_cmd_create(JsonObject * cmd_json) {
 	if (pcmd) {
 		pcmd->_cmd_json = json_object_ref (cmd_json);
 		pcmd->cmd_string = json_object_get_string_member (cmd_json, "cmd");
+		pcmd->cmds = json_object_has_member (cmd_json, "cmds")
+			? json_object_get_array_member (cmd_json, "cmds"): NULL;
 		pcmd->serial = json_object_get_int_member (cmd_json, "serial");
 	}
 	return pcmd;
@@ -239,113 +568,244 @@ static bool user_wants_safe_io(void) {
 	return do_want;
 }
 
-static RIODesc *__open(RIO *io, const char *pathname, int rw, int mode) {
-	GError *error = NULL;
+static void timings_init(RFTimings *t) {
+	char *env = r_sys_getenv ("R2FRIDA_TIMINGS");
+	t->enabled = env && *env && strcmp (env, "0");
+	t->start = t->last = g_get_monotonic_time ();
+	free (env);
+}
 
-	R2FridaLaunchOptions *lo = r2frida_launchopt_new (pathname);
-	if (!lo) {
-		return NULL;
+/* prints the time spent since the previous mark when R2FRIDA_TIMINGS is set */
+static void timings_mark(RFTimings *t, const char *phase) {
+	if (t->enabled) {
+		const gint64 now = g_get_monotonic_time ();
+		eprintf ("r2frida: %-16s %8.2f ms\n", phase, (now - t->last) / 1000.0);
+		t->last = now;
 	}
+}
 
-	frida_init ();
+static void timings_done(RFTimings *t) {
+	if (t->enabled) {
+		eprintf ("r2frida: %-16s %8.2f ms\n", "total", (g_get_monotonic_time () - t->start) / 1000.0);
+	}
+}
 
-	RIOFrida *rf = r_io_frida_new (io);
-	if (!rf) {
-		goto error;
+static bool user_wants_reuse(void) {
+	bool do_want = false;
+	char *env = r_sys_getenv ("R2FRIDA_REUSE");
+	if (env) {
+		do_want = *env && strcmp (env, "0");
+		free (env);
 	}
+	return do_want;
+}
 
-	if (!device_manager) {
-		device_manager = frida_device_manager_new ();
+/* forget the shared session, it is only freed when no descriptor uses it anymore */
+static void session_reuse_drop(void) {
+	RIOFrida *rf = reused_session;
+	reused_session = NULL;
+	R_FREE (reused_uri);
+	if (rf && rf->refs == 0) {
+		rf->detached = true;
+		r_io_frida_free (rf);
 	}
-	device_manager_count++;
+}
 
-	if (!__check (io, pathname, false)) {
-		goto error;
+/* the agent keeps its caches and traces, it only needs to learn the offset and the suspended state again */
+static bool session_sync_state(RIOFrida *rf) {
+	char offstr[127] = {0};
+	JsonBuilder *builder = build_request ("state");
+	json_builder_set_member_name (builder, "offset");
+	snprintf (offstr, sizeof (offstr), "0x%"PFMT64x, rf->io->off);
+	json_builder_add_string_value (builder, offstr);
+	json_builder_set_member_name (builder, "suspended");
+	json_builder_add_boolean_value (builder, rf->suspended);
+
+	JsonObject *result = perform_request (rf, builder, NULL, NULL);
+	if (!result) {
+		return false;
 	}
 
-	bool rc = resolve_target (pathname, lo, rf->cancellable);
-	if (!rc) {
-		goto error;
+	json_object_unref (result);
+
+	return true;
+}
+
+/* returns the shared session when it was opened with the same uri and is still attached */
+static RIOFrida *session_reuse_take(RIO *io, const char *pathname) {
+	RIOFrida *rf = reused_session;
+	if (!rf) {
+		return NULL;
 	}
-	if (R_STR_ISEMPTY (lo->device_id)) {
-		lo->device_id = strdup ("local");
+	if (!user_wants_reuse () || rf->detached || strcmp (reused_uri, pathname)) {
+		session_reuse_drop ();
+		return NULL;
 	}
-	const char *devid = (R_STR_ISEMPTY (lo->device_id))? NULL: lo->device_id;
-	rc = resolve_device (device_manager, devid, &rf->device, rf->cancellable);
-	if (rc && rf->device) {
-		if (!lo->spawn && !resolve_process (rf->device, lo, rf->cancellable)) {
-			goto error;
-		}
+	rf->refs++;
+	rf->io = io;
+	rf->r2core = io->corebind.core;
+	if (!session_sync_state (rf)) {
+		rf->refs--;
+		session_reuse_drop ();
+		return NULL;
 	}
-	if (R_STR_ISEMPTY (lo->process_specifier)) {
-		if (dumpApplications (rf->device, rf->cancellable) == 0) {
-			dumpProcesses (rf->device, rf->cancellable);
+	return rf;
+}
+
+static bool user_wants_bytecode(void) {
+	bool do_want = true;
+	char *env = r_sys_getenv ("R2FRIDA_BYTECODE");
+	if (env) {
+		if (!strcmp (env, "0")) {
+			do_want = false;
 		}
+		free (env);
 	}
-	if (r2f_debug ()) {
-		printf ("device: %s\n", r_str_get (lo->device_id));
-		printf ("pname: %s\n", r_str_get (lo->process_specifier));
-		printf ("pid: %d\n", lo->pid);
-		printf ("spawn: %s\n", r_str_bool (lo->spawn));
-		printf ("run: %s\n", r_str_bool (lo->run));
-		printf ("pid_valid: %s\n", r_str_bool (lo->pid_valid));
-		goto error;
+	return do_want;
+}
+
+static char *bytecode_cache_dir(void) {
+	char *dir = r_str_home (R_JOIN_2_PATHS (".cache", "r2frida"));
+	if (dir && !r_sys_mkdirp (dir)) {
+		R_FREE (dir);
 	}
-	if (!rc) {
-		goto error;
+	return dir;
+}
+
+// device ids may be host:port or contain path separators
+static char *bytecode_device_id(RIOFrida *rf) {
+	char *id = strdup (frida_device_get_id (rf->device));
+	char *p;
+	for (p = id; p && *p; p++) {
+		if (!isalnum ((unsigned char)*p) && *p != '-' && *p != '.') {
+			*p = '_';
+		}
 	}
-	if (!rf->device) {
-		eprintf ("This should never happen.\n");
-		// rf->device = get_device_manager (device_manager, "local", rf->cancellable, &error);
-		goto error;
+	return id;
+}
+
+/* ~/.cache/r2frida/runtime-<device id> holds the Frida version the agent reported last time on that device */
+static char *bytecode_runtime_path(RIOFrida *rf) {
+	char *dir = bytecode_cache_dir ();
+	char *id = bytecode_device_id (rf);
+	char *path = (dir && id)? r_str_newf ("%s" R_SYS_DIR "runtime-%s", dir, id): NULL;
+	free (id);
+	free (dir);
+	return path;
+}
+
+static bool bytecode_write(const char *path, const ut8 *buf, size_t len) {
+	char *tmp = r_str_newf ("%s.%d.tmp", path, r_sys_getpid ());
+	bool ok = r_file_dump (tmp, buf, len, false);
+	if (ok && rename (tmp, path) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		r_file_rm (tmp);
 	}
+	free (tmp);
+	return ok;
+}
 
-	if (lo->spawn) {
-		char **argv = r_str_argv (lo->process_specifier, NULL);
-		if (!argv) {
-			eprintf ("Invalid process specifier\n");
-			goto error;
-		}
-		if (!*argv) {
-			eprintf ("Invalid arguments for spawning\n");
-			r_str_argv_free (argv);
-			goto error;
+static void bytecode_runtime_save(RIOFrida *rf, const char *runtime) {
+	char *path = bytecode_runtime_path (rf);
+	if (path) {
+		size_t len = 0;
+		char *old = r_file_slurp (path, &len);
+		if (!old || strcmp (old, runtime)) {
+			bytecode_write (path, (const ut8 *)runtime, strlen (runtime));
 		}
+		free (old);
+		free (path);
+	}
+}
 
-		FridaSpawnOptions *options = frida_spawn_options_new ();
-		const int argc = g_strv_length (argv);
-		if (argc > 1) {
-			frida_spawn_options_set_argv (options, argv, argc);
+/*
+ * ~/.cache/r2frida/agent-<device id>-<runtime version>-<sha256 of the agent source>.qjs
+ * the bytecode is only usable by the runtime that compiled it, so nothing is cached until
+ * the agent has told us its Frida version on this device once
+ */
+static char *bytecode_cache_path(RIOFrida *rf, const char *code, size_t size) {
+	char *runtime_path = bytecode_runtime_path (rf);
+	char *runtime = runtime_path? r_file_slurp (runtime_path, NULL): NULL;
+	char *path = NULL;
+	if (R_STR_ISNOTEMPTY (runtime)) {
+		char *hash = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guint8 *)code, size);
+		char *dir = bytecode_cache_dir ();
+		char *id = bytecode_device_id (rf);
+		if (hash && dir && id) {
+			path = r_str_newf ("%s" R_SYS_DIR "agent-%s-%s-%s.qjs", dir, id, r_str_trim_head_ro (runtime), hash);
 		}
-		rf->pid = frida_device_spawn_sync (rf->device, argv[0], options, rf->cancellable, &error);
-		g_object_unref (options);
-		r_str_argv_free (argv);
+		g_free (hash);
+		free (dir);
+		free (id);
+	}
+	free (runtime);
+	free (runtime_path);
+	return path;
+}
 
-		if (error) {
-			if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-				eprintf ("Cannot spawn: %s\n", error->message);
+/* the agent is compiled once to QuickJS bytecode and cached on disk, any failure falls back to the source */
+static FridaScript *script_create(RIOFrida *rf, const char *code, size_t size, FridaScriptOptions *options, RFTimings *t) {
+	GError *error = NULL;
+	FridaScript *script = NULL;
+	char *path = user_wants_bytecode ()? bytecode_cache_path (rf, code, size): NULL;
+	if (path) {
+		size_t len = 0;
+		char *cached = r_file_slurp (path, &len);
+		GBytes *bytes = NULL;
+		if (cached) {
+			bytes = g_bytes_new_take (cached, len);
+			timings_mark (t, "bytecode-read");
+		} else {
+			bytes = frida_session_compile_script_sync (rf->session, code, options, rf->cancellable, &error);
+			if (bytes) {
+				gsize n = 0;
+				const ut8 *buf = g_bytes_get_data (bytes, &n);
+				if (!bytecode_write (path, buf, n)) {
+					eprintf ("Cannot write %s\n", path);
+				}
 			}
-			goto error;
+			g_clear_error (&error);
+			timings_mark (t, "bytecode-compile");
 		}
-		if (lo->run) {
-			rf->suspended = false;
-		} else {
-			rf->suspended = true;
+		if (bytes) {
+			script = frida_session_create_script_from_bytes_sync (rf->session, bytes, options, rf->cancellable, &error);
+			g_bytes_unref (bytes);
+			if (!script) {
+				// stale or made by a different frida-server, compile it again next time
+				r_file_rm (path);
+				g_clear_error (&error);
+			}
+		}
+		free (path);
+		if (script) {
+			timings_mark (t, "script-create");
+			return script;
 		}
-	} else {
-		rf->pid = lo->pid;
-		rf->suspended = false;
 	}
-	if (!rf->device) {
-		error = NULL;
-		goto error;
+	script = frida_session_create_script_sync (rf->session, code, options, rf->cancellable, &error);
+	if (error) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			eprintf ("Cannot create script: %s\n", error->message);
+		}
+		g_clear_error (&error);
 	}
+	timings_mark (t, "script-create");
+	return script;
+}
+
+/* attach to rf->pid on rf->device and load the agent, shared by the main session and its peers */
+static bool session_attach(RIOFrida *rf, RFTimings *t) {
+	GError *error = NULL;
+
 	rf->session = frida_device_attach_sync (rf->device, rf->pid, rf->cancellable, &error);
+	timings_mark (t, "attach");
 	if (error) {
 		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
 			eprintf ("Cannot attach: %s\n", error->message);
 		}
-		goto error;
+		goto fail;
 	}
 
 	FridaScriptOptions * options = frida_script_options_new ();
@@ -371,55 +831,324 @@ static RIODesc *__open(RIO *io, const char *pathname, int rw, int mode) {
 		code_size = sizeof (r_io_frida_agent_code) - 1;
 	}
 
-	rf->script = frida_session_create_script_sync (rf->session, code_buf, options, rf->cancellable, &error);
+	rf->script = script_create (rf, code_buf, code_size, options, t);
 
 	free (code_malloc_data);
 
-	if (error) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-			eprintf ("Cannot create script: %s\n", error->message);
-		}
-		goto error;
+	if (!rf->script) {
+		goto fail;
 	}
 
 	g_signal_connect (rf->script, "message", G_CALLBACK (on_message), rf);
 	g_signal_connect (rf->session, "detached", G_CALLBACK (on_detached), rf);
 
 	frida_script_load_sync (rf->script, rf->cancellable, &error);
+	timings_mark (t, "script-load");
 	if (error) {
 		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
 			eprintf ("Cannot load script: %s\n", error->message);
 		}
-		goto error;
+		goto fail;
 	}
 
-	r2frida_launchopt_free (lo);
 	if (user_wants_safe_io ()) {
 		__request_safe_io (rf);
 	}
+	__request_compression (rf);
+	timings_mark (t, "handshake");
+	return true;
 
-	const char *autocompletions[] = {
-		"!!!\\chcon",
-		"!!!\\eval",
-		"!!!\\e",
-		"!!!\\e/",
-		"!!!\\env",
-		"!!!\\j",
-		"!!!\\i",
-		"!!!\\ii",
-		"!!!\\il",
-		"!!!\\is",
-		"!!!\\isa $flag",
-		"!!!\\iE",
-		"!!!\\iEa $flag",
-		"!!!\\ic",
-		"!!!\\ip",
-		"!!!\\init",
-		"!!!\\fd $flag",
-		"!!!\\dd",
-		"!!!\\ddj",
-		"!!!\\?",
-		"!!!\\?V",
+fail:
+	g_clear_error (&error);
+	return false;
+}
+
+/* peers share the device and the device manager, commands reach them with \* */
+static RIOFrida *session_add_peer(RIOFrida *rf, guint pid) {
+	RIOFrida *peer = r_io_frida_new (rf->io);
+	RFTimings t;
+	if (!peer) {
+		return NULL;
+	}
+	peer->device = g_object_ref (rf->device);
+	peer->pid = pid;
+	device_manager_count++;
+	timings_init (&t);
+	if (!session_attach (peer, &t)) {
+		eprintf ("Cannot attach to %u\n", pid);
+		r_io_frida_free (peer);
+		return NULL;
+	}
+	timings_done (&t);
+	if (!rf->peers) {
+		rf->peers = g_ptr_array_new_with_free_func ((GDestroyNotify)r_io_frida_free);
+	}
+	g_ptr_array_add (rf->peers, peer);
+	return peer;
+}
+
+static void session_print_labelled(RIO *io, guint pid, const char *text) {
+	const char *line = text;
+	while (*line) {
+		const char *eol = strchr (line, '\n');
+		const int len = eol? (int)(eol - line): (int)strlen (line);
+		io->cb_printf ("[%u] %.*s\n", pid, len, line);
+		if (!eol) {
+			break;
+		}
+		line = eol + 1;
+	}
+}
+
+/* the command is posted to every session before waiting for any reply, so the agents run it concurrently */
+static void session_fanout(RIOFrida *rf, const char *command) {
+	GPtrArray *sessions = g_ptr_array_new ();
+	guint i;
+
+	g_ptr_array_add (sessions, rf);
+	for (i = 0; rf->peers && i < rf->peers->len; i++) {
+		g_ptr_array_add (sessions, g_ptr_array_index (rf->peers, i));
+	}
+	bool *posted = R_NEWS0 (bool, sessions->len);
+	for (i = 0; i < sessions->len; i++) {
+		RIOFrida *s = g_ptr_array_index (sessions, i);
+		if (s->detached) {
+			continue;
+		}
+		JsonBuilder *builder = build_request ("perform");
+		json_builder_set_member_name (builder, "command");
+		json_builder_add_string_value (builder, command);
+		request_add_state (s, builder);
+		s->capture = g_string_new (NULL);
+		posted[i] = request_post (s, builder, NULL);
+	}
+	for (i = 0; i < sessions->len; i++) {
+		RIOFrida *s = g_ptr_array_index (sessions, i);
+		if (!posted[i]) {
+			eprintf ("[%u] %s\n", s->pid, s->detached? "detached": "cannot send the command");
+		} else {
+			JsonObject *result = request_wait (s, NULL);
+			if (result) {
+				const char *value = json_object_has_member (result, "value")
+					? json_object_get_string_member (result, "value"): NULL;
+				if (value && strcmp (value, "undefined")) {
+					g_string_append (s->capture, value);
+				}
+				json_object_unref (result);
+			}
+			session_print_labelled (rf->io, s->pid, s->capture->str);
+		}
+		if (s->capture) {
+			g_string_free (s->capture, TRUE);
+			s->capture = NULL;
+		}
+	}
+	free (posted);
+	g_ptr_array_free (sessions, TRUE);
+}
+
+static void session_cmd(RIOFrida *rf, const char *args) {
+	guint i;
+	switch (*args) {
+	case ' ':
+		session_fanout (rf, r_str_trim_head_ro (args));
+		break;
+	case 'l':
+		rf->io->cb_printf ("%u main%s\n", rf->pid, rf->detached? " detached": "");
+		for (i = 0; rf->peers && i < rf->peers->len; i++) {
+			RIOFrida *peer = g_ptr_array_index (rf->peers, i);
+			rf->io->cb_printf ("%u peer%s\n", peer->pid, peer->detached? " detached": "");
+		}
+		break;
+	case '+':
+		{
+			GArray *pids = resolve_pids (rf->device, r_str_trim_head_ro (args + 1), rf->cancellable);
+			guint j;
+			for (j = 0; pids && j < pids->len; j++) {
+				const guint pid = g_array_index (pids, guint, j);
+				bool found = pid == rf->pid;
+				for (i = 0; !found && rf->peers && i < rf->peers->len; i++) {
+					found = ((RIOFrida *)g_ptr_array_index (rf->peers, i))->pid == pid;
+				}
+				if (!found && session_add_peer (rf, pid)) {
+					rf->io->cb_printf ("Attached to %u\n", pid);
+				}
+			}
+			if (pids) {
+				g_array_free (pids, TRUE);
+			}
+		}
+		break;
+	case '-':
+		{
+			bool valid = false;
+			const guint pid = atopid (r_str_trim_head_ro (args + 1), &valid);
+			for (i = 0; valid && rf->peers && i < rf->peers->len; i++) {
+				if (((RIOFrida *)g_ptr_array_index (rf->peers, i))->pid == pid) {
+					g_ptr_array_remove_index (rf->peers, i);
+					return;
+				}
+			}
+			eprintf ("No peer session for that pid, see \\*l\n");
+		}
+		break;
+	default:
+		eprintf ("Usage: \\*[l+-] [args]  # run agent commands in several processes at once\n");
+		eprintf ("\\* <cmd>          run the command in every session, output lines are prefixed by [pid]\n");
+		eprintf ("\\*l               list the sessions\n");
+		eprintf ("\\*+ pid,..|~name  attach to more processes of the same device\n");
+		eprintf ("\\*- pid           detach from a peer process\n");
+		break;
+	}
+}
+
+static RIODesc *__open(RIO *io, const char *pathname, int rw, int mode) {
+	GError *error = NULL;
+	RFTimings t;
+
+	timings_init (&t);
+	RIOFrida *reused = session_reuse_take (io, pathname);
+	if (reused) {
+		timings_mark (&t, "reuse");
+		return r_io_desc_new (io, &r_io_plugin_frida, pathname, R_PERM_RWX, mode, reused);
+	}
+	R2FridaLaunchOptions *lo = r2frida_launchopt_new (pathname);
+	if (!lo) {
+		return NULL;
+	}
+
+	frida_init ();
+	timings_mark (&t, "frida-init");
+
+	RIOFrida *rf = r_io_frida_new (io);
+	if (!rf) {
+		goto error;
+	}
+
+	if (!device_manager) {
+		device_manager = frida_device_manager_new ();
+	}
+	device_manager_count++;
+
+	if (!__check (io, pathname, false)) {
+		goto error;
+	}
+
+	bool rc = resolve_target (pathname, lo, rf->cancellable);
+	timings_mark (&t, "resolve-target");
+	if (!rc) {
+		goto error;
+	}
+	if (R_STR_ISEMPTY (lo->device_id)) {
+		lo->device_id = strdup ("local");
+	}
+	const char *devid = (R_STR_ISEMPTY (lo->device_id))? NULL: lo->device_id;
+	rc = resolve_device (device_manager, devid, &rf->device, rf->cancellable);
+	timings_mark (&t, "resolve-device");
+	if (rc && rf->device) {
+		if (!lo->spawn && !resolve_process (rf->device, lo, rf->cancellable)) {
+			goto error;
+		}
+		timings_mark (&t, "resolve-process");
+	}
+	if (R_STR_ISEMPTY (lo->process_specifier)) {
+		dumpApplicationsOrProcesses (rf->device, rf->cancellable);
+	}
+	if (r2f_debug ()) {
+		printf ("device: %s\n", r_str_get (lo->device_id));
+		printf ("pname: %s\n", r_str_get (lo->process_specifier));
+		printf ("pid: %d\n", lo->pid);
+		printf ("spawn: %s\n", r_str_bool (lo->spawn));
+		printf ("run: %s\n", r_str_bool (lo->run));
+		printf ("pid_valid: %s\n", r_str_bool (lo->pid_valid));
+		goto error;
+	}
+	if (!rc) {
+		goto error;
+	}
+	if (!rf->device) {
+		eprintf ("This should never happen.\n");
+		// rf->device = get_device_manager (device_manager, "local", rf->cancellable, &error);
+		goto error;
+	}
+
+	if (lo->spawn) {
+		char **argv = r_str_argv (lo->process_specifier, NULL);
+		if (!argv) {
+			eprintf ("Invalid process specifier\n");
+			goto error;
+		}
+		if (!*argv) {
+			eprintf ("Invalid arguments for spawning\n");
+			r_str_argv_free (argv);
+			goto error;
+		}
+
+		FridaSpawnOptions *options = frida_spawn_options_new ();
+		const int argc = g_strv_length (argv);
+		if (argc > 1) {
+			frida_spawn_options_set_argv (options, argv, argc);
+		}
+		rf->pid = frida_device_spawn_sync (rf->device, argv[0], options, rf->cancellable, &error);
+		g_object_unref (options);
+		r_str_argv_free (argv);
+
+		if (error) {
+			if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+				eprintf ("Cannot spawn: %s\n", error->message);
+			}
+			goto error;
+		}
+		if (lo->run) {
+			rf->suspended = false;
+		} else {
+			rf->suspended = true;
+		}
+		timings_mark (&t, "spawn");
+	} else {
+		rf->pid = lo->pid;
+		rf->suspended = false;
+	}
+	if (!rf->device) {
+		error = NULL;
+		goto error;
+	}
+	if (!session_attach (rf, &t)) {
+		goto error;
+	}
+	direct_io_init (rf);
+	__request_shm (rf);
+	if (lo->pids) {
+		guint i;
+		for (i = 0; i < lo->pids->len; i++) {
+			session_add_peer (rf, g_array_index (lo->pids, guint, i));
+		}
+		timings_mark (&t, "peers");
+	}
+	r2frida_launchopt_free (lo);
+
+	const char *autocompletions[] = {
+		"!!!\\chcon",
+		"!!!\\eval",
+		"!!!\\e",
+		"!!!\\e/",
+		"!!!\\env",
+		"!!!\\j",
+		"!!!\\i",
+		"!!!\\ii",
+		"!!!\\il",
+		"!!!\\is",
+		"!!!\\isa $flag",
+		"!!!\\iE",
+		"!!!\\iEa $flag",
+		"!!!\\ic",
+		"!!!\\ip",
+		"!!!\\init",
+		"!!!\\fd $flag",
+		"!!!\\dd",
+		"!!!\\ddj",
+		"!!!\\?",
+		"!!!\\?V",
 		"!!!\\/",
 		"!!!\\/w",
 		"!!!\\/wj",
@@ -470,10 +1199,17 @@ static RIODesc *__open(RIO *io, const char *pathname, int rw, int mode) {
 	for (i = 0; autocompletions[i]; i++) {
 		io->corebind.cmd (rf->r2core, autocompletions[i]);
 	}
+	timings_mark (&t, "autocompletions");
+	if (user_wants_reuse () && !reused_session) {
+		reused_session = rf;
+		reused_uri = strdup (pathname);
+	}
 	RIODesc *fd = r_io_desc_new (io, &r_io_plugin_frida, pathname, R_PERM_RWX, mode, rf);
 	if (lo->run) {
 		resume (rf);
+		timings_mark (&t, "resume");
 	}
+	timings_done (&t);
 	return fd;
 
 error:
@@ -494,14 +1230,132 @@ static int __close(RIODesc *fd) {
 	}
 
 	rf = fd->data;
+	fd->data = NULL;
+	rf->refs--;
+	if (rf->refs > 0) {
+		return 0;
+	}
+	if (rf == reused_session) {
+		if (user_wants_reuse () && !rf->detached) {
+			// kept attached with the agent loaded until the next open of the same uri
+			resume (rf);
+			log_writers_flush (rf, true);
+			return 0;
+		}
+		reused_session = NULL;
+		R_FREE (reused_uri);
+	}
 	rf->detached = true;
 	resume (rf);
-	r_io_frida_free (fd->data);
-	fd->data = NULL;
+	r_io_frida_free (rf);
 
 	return 0;
 }
 
+static bool user_wants_direct_io(void) {
+	bool do_want = false;
+	char *env = r_sys_getenv ("R2FRIDA_DIRECT_IO");
+	if (env) {
+		do_want = *env && strcmp (env, "0");
+		free (env);
+	}
+	return do_want;
+}
+
+static void direct_io_load_maps(RIOFrida *rf) {
+	char path[64];
+	char line[1024];
+	snprintf (path, sizeof (path), "/proc/%u/maps", rf->pid);
+	g_array_set_size (rf->direct.ranges, 0);
+	rf->direct.loaded = g_get_monotonic_time ();
+	FILE *fp = fopen (path, "r");
+	if (!fp) {
+		return;
+	}
+	while (fgets (line, sizeof (line), fp)) {
+		ut64 start, end;
+		char perm[8];
+		if (sscanf (line, "%"PFMT64x"-%"PFMT64x" %7s", &start, &end, perm) != 3 || perm[0] != 'r') {
+			continue;
+		}
+		const guint n = rf->direct.ranges->len;
+		if (n > 0 && g_array_index (rf->direct.ranges, ut64, n - 1) == start) {
+			g_array_index (rf->direct.ranges, ut64, n - 1) = end;
+		} else {
+			g_array_append_val (rf->direct.ranges, start);
+			g_array_append_val (rf->direct.ranges, end);
+		}
+	}
+	fclose (fp);
+}
+
+/* maps are sorted by address, so a binary search finds the mapping holding addr */
+static bool direct_io_readable(RIOFrida *rf, ut64 addr, int count) {
+	const ut64 *r = (const ut64 *)rf->direct.ranges->data;
+	guint lo = 0, hi = rf->direct.ranges->len / 2;
+	while (lo < hi) {
+		const guint mid = (lo + hi) / 2;
+		if (addr < r[mid * 2]) {
+			hi = mid;
+		} else if (addr >= r[mid * 2 + 1]) {
+			lo = mid + 1;
+		} else {
+			return addr + count <= r[mid * 2 + 1];
+		}
+	}
+	return false;
+}
+
+static void direct_io_init(RIOFrida *rf) {
+#if __linux__
+	if (!user_wants_direct_io () || frida_device_get_dtype (rf->device) != FRIDA_DEVICE_TYPE_LOCAL) {
+		return;
+	}
+	rf->direct.ranges = g_array_new (FALSE, FALSE, sizeof (ut64));
+	direct_io_load_maps (rf);
+	rf->direct.enabled = rf->direct.ranges->len > 0;
+	if (!rf->direct.enabled) {
+		eprintf ("Cannot read /proc/%u/maps, memory goes through the agent\n", rf->pid);
+	}
+#endif
+}
+
+static void direct_io_fini(RIOFrida *rf) {
+	if (rf->direct.ranges) {
+		g_array_free (rf->direct.ranges, TRUE);
+		rf->direct.ranges = NULL;
+	}
+	rf->direct.enabled = false;
+}
+
+/* returns false when the agent has to do it: unmapped or protected pages, or no ptrace rights */
+static bool direct_io_transfer(RIOFrida *rf, ut64 addr, ut8 *buf, int count, bool write) {
+#if __linux__
+	if (!direct_io_readable (rf, addr, count)) {
+		// new mappings show up in the next reload, at most every 50ms
+		if (g_get_monotonic_time () - rf->direct.loaded < 50 * G_TIME_SPAN_MILLISECOND) {
+			return false;
+		}
+		direct_io_load_maps (rf);
+		if (!direct_io_readable (rf, addr, count)) {
+			return false;
+		}
+	}
+	struct iovec local = { buf, count };
+	struct iovec remote = { (void *)(size_t)addr, count };
+	const ssize_t n = write
+		? process_vm_writev (rf->pid, &local, 1, &remote, 1, 0)
+		: process_vm_readv (rf->pid, &local, 1, &remote, 1, 0);
+	if (n < 0 && (errno == EPERM || errno == ENOSYS)) {
+		eprintf ("Cannot access the memory of %u directly, memory goes through the agent\n", rf->pid);
+		rf->direct.enabled = false;
+	}
+	return n == count;
+#else
+	return false;
+#endif
+}
+
 static int __read(RIO *io, RIODesc *fd, ut8 *buf, int count) {
 	GBytes *bytes;
 	gsize n;
@@ -509,6 +1363,13 @@ static int __read(RIO *io, RIODesc *fd, ut8 *buf, int count) {
 	r_return_val_if_fail (io && fd && fd->data && buf && count > 0, -1);
 
 	RIOFrida *rf = fd->data;
+	if (rf->direct.enabled) {
+		if (direct_io_transfer (rf, io->off, buf, count, false)) {
+			rf->direct.reads++;
+			return count;
+		}
+		rf->direct.fallbacks++;
+	}
 
 	JsonBuilder *builder = build_request ("read");
 	json_builder_set_member_name (builder, "offset");
@@ -575,6 +1436,14 @@ static int __write(RIO *io, RIODesc *fd, const ut8 *buf, int count) {
 	}
 
 	RIOFrida *rf = fd->data;
+	if (rf->direct.enabled) {
+		// read-only pages fail here, the agent changes their protection first
+		if (direct_io_transfer (rf, io->off, (ut8 *)buf, count, true)) {
+			rf->direct.writes++;
+			return count;
+		}
+		rf->direct.fallbacks++;
+	}
 
 	JsonBuilder *builder = build_request ("write");
 	json_builder_set_member_name (builder, "offset");
@@ -593,6 +1462,52 @@ static bool __resize(RIO *io, RIODesc *fd, ut64 count) {
 	return false;
 }
 
+// the counters of this side of the wire, printed after the ones of the agent by ?z
+static void host_stats_print(RIOFrida *rf) {
+	RIO *io = rf->io;
+	io->cb_printf ("unpacked.messages\t%"PFMT64u"\n", rf->wire.messages);
+	io->cb_printf ("unpacked.packed\t%"PFMT64u"\n", rf->wire.packed);
+	io->cb_printf ("unpacked.raw\t%"PFMT64u"\n", rf->wire.unpacked);
+	io->cb_printf ("unpacked.usec\t%"PFMT64d"\n", (st64)rf->wire.usec);
+	if (rf->shm.base) {
+		io->cb_printf ("shm.messages\t%"PFMT64u"\n", rf->shm.messages);
+		io->cb_printf ("shm.bytes\t%"PFMT64u"\n", rf->shm.bytes);
+	}
+	if (rf->direct.enabled) {
+		io->cb_printf ("direct.reads\t%"PFMT64u"\n", rf->direct.reads);
+		io->cb_printf ("direct.writes\t%"PFMT64u"\n", rf->direct.writes);
+		io->cb_printf ("direct.fallbacks\t%"PFMT64u"\n", rf->direct.fallbacks);
+	}
+}
+
+// same counters merged into the object printed by ?zj in the agent
+static char *host_stats_json(RIOFrida *rf, const char *agent) {
+	JsonNode *node = json_from_string (agent, NULL);
+	if (!node || !JSON_NODE_HOLDS_OBJECT (node)) {
+		if (node) {
+			json_node_unref (node);
+		}
+		return NULL;
+	}
+	JsonObject *o = json_node_get_object (node);
+	json_object_set_int_member (o, "unpacked.messages", rf->wire.messages);
+	json_object_set_int_member (o, "unpacked.packed", rf->wire.packed);
+	json_object_set_int_member (o, "unpacked.raw", rf->wire.unpacked);
+	json_object_set_int_member (o, "unpacked.usec", rf->wire.usec);
+	if (rf->shm.base) {
+		json_object_set_int_member (o, "shm.messages", rf->shm.messages);
+		json_object_set_int_member (o, "shm.bytes", rf->shm.bytes);
+	}
+	if (rf->direct.enabled) {
+		json_object_set_int_member (o, "direct.reads", rf->direct.reads);
+		json_object_set_int_member (o, "direct.writes", rf->direct.writes);
+		json_object_set_int_member (o, "direct.fallbacks", rf->direct.fallbacks);
+	}
+	char *res = json_to_string (node, FALSE);
+	json_node_unref (node);
+	return res;
+}
+
 static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 	JsonBuilder *builder;
 	JsonObject *result;
@@ -603,12 +1518,17 @@ static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 		io->cb_printf ("r2frida commands available via =! or \\ prefix\n"
 		". script                   Run script\n"
 		"  frida-expression         Run given expression inside the agent\n"
+		"& <cmd>                    Run an agent command in the background, &[l] lists the jobs\n"
+		"&= <id>                    Fetch the result of a job (&- <id> cancels it)\n"
+		"* <cmd>                    Run the command in all the attached processes (see \\*?)\n"
 		"/[x][j] <string|hexpairs>  Search hex/string pattern in memory ranges (see search.in=?)\n"
 		"/v[1248][j] value          Search for a value honoring `e cfg.bigendian` of given width\n"
 		"/w[j] string               Search wide string\n"
 		"<space> code..             Evaluate Cycript code\n"
 		"?                          Show this help\n"
 		"?V                         Show target Frida version\n"
+		"?m[j]                      Show the agent heap, startup time and subsystems loaded so far\n"
+		"?z[j]                      Show the compression ratio and time of large messages and the host wire counters (see io.compress)\n"
 		"chcon file                 Change SELinux context (dl might require this)\n"
 		"d.                         Start the chrome tools debugger\n"
 		"db (<addr>|<sym>)          List or place breakpoint\n"
@@ -634,15 +1554,25 @@ static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 		"dmp <addr> <size> <perms>  Change page at <address> with <size>, protection <perms> (rwx)\n"
 		"dp                         Show current pid\n"
 		"dpt                        Show threads\n"
+		"dps[mcj] [seconds]         Sample the pc of all threads, show the profile (m=modules, c=collapsed stacks)\n"
 		"dr                         Show thread registers (see dpt)\n"
 		"dt (<addr>|<sym>) ..       Trace list of addresses or symbols\n"
-		"dt- (<addr>|<sym>)         Clear trace\n"
+		"dt- <id>                   Clear trace by id (see dt)\n"
 		"dt-*                       Clear all tracing\n"
 		"dt.                        Trace at current offset\n"
+		"dto [id|*] [key=value ..]  Show or set trace sample=N, rate=N (per second) and limit=N\n"
 		"dtf <addr> [fmt]           Trace address with format (^ixzO) (see dtf?)\n"
 		"dth (addr|sym)(x:0 y:1 ..) Define function header (z=str,i=int,v=hex barray,s=barray)\n"
-		"dtl[-*] [msg]              debug trace log console, useful to .\\T*\n"
+		"dtl[*jq] [key=value ..]    Show trace log, filter by trace= tid= from= to= offset= count=\n"
+		"dtl-[*]                    Clear the trace log\n"
+		"dtls                       Show trace log capacity and drop counters\n"
+		"dtp[jt] [addr|sym] ..      Profile functions, list latencies merged (j=json, t=per thread)\n"
+		"dtp-[*] [addr|sym]         Stop profiling one or all functions (dtpr resets the counters)\n"
 		"dtr <addr> (<regs>...)     Trace register values\n"
+		"dtc[*j]                    Show blocks covered with e stalker.event=coverage (*=flags)\n"
+		"dtcd <file>                Save the coverage as a drcov file, dtc- clears it\n"
+		"dtg[*jt]                   Show call edges with e stalker.event=callgraph (*=xrefs, t=per thread)\n"
+		"dtg-                       Clear the call graph\n"
 		"dts[*j] seconds            Trace all threads for given seconds using the stalker\n"
 		"dtsf[*j] [sym|addr]        Trace address or symbol using the stalker (Frida >= 10.3.13)\n"
 		"dxc [sym|addr] [args..]    Call the target symbol with given args\n"
@@ -666,26 +1596,12 @@ static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 
 	RIOFrida *rf = fd->data;
 
-	/* update state (seek and suspended) in agent */
-	{
-		char offstr[127] = {0};
-		JsonBuilder *builder = build_request ("state");
-		json_builder_set_member_name (builder, "offset");
-		snprintf (offstr, sizeof (offstr), "0x%"PFMT64x, io->off);
-		json_builder_add_string_value (builder, offstr);
-		json_builder_set_member_name (builder, "suspended");
-		json_builder_add_boolean_value (builder, rf->suspended);
-		JsonObject *result = perform_request (rf, builder, NULL, NULL);
-		if (result) {
-			json_object_unref (result);
-		} else if (!strncmp (command, "dkr", 3)) {
-			// let it pass
-		} else {
-			return NULL;
-		}
-	}
+	log_writers_flush (rf, true);
 
-	if (!strcmp (command, "")) {
+	if (command[0] == '*') {
+		session_cmd (rf, command + 1);
+		return NULL;
+	} else if (!strcmp (command, "")) {
 		r_core_cmd0 (rf->r2core, ".=!i*");
 		return NULL;
 	} else if (!strncmp (command, "o/", 2)) {
@@ -724,6 +1640,32 @@ static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 		io->cb_printf ("  stalker.event   = compile\n");
 		io->cb_printf ("  stalker.timeout = 300\n");
 		io->cb_printf ("  stalker.in      = raw\n");
+		io->cb_printf ("  sampler.hz      = 100\n");
+		io->cb_printf ("  sampler.depth   = 0\n");
+		io->cb_printf ("  stalker.file    = \n");
+		io->cb_printf ("  stalker.modules = \n");
+		io->cb_printf ("  stalker.exclude = \n");
+		io->cb_printf ("  stalker.threads = \n");
+		io->cb_printf ("  stalker.threads.exclude = \n");
+		io->cb_printf ("  stalker.threads.poll = 500\n");
+		io->cb_printf ("  stalker.queue.capacity = 16384\n");
+		io->cb_printf ("  stalker.queue.drain = 250\n");
+		io->cb_printf ("  hook.logs.size  = 4096\n");
+		io->cb_printf ("  hook.logs.policy = overwrite\n");
+		io->cb_printf ("  hook.sample     = 1\n");
+		io->cb_printf ("  hook.rate       = 0\n");
+		io->cb_printf ("  hook.limit      = 0\n");
+		io->cb_printf ("  hook.batch.interval = 50\n");
+		io->cb_printf ("  hook.batch.size = 1024\n");
+		io->cb_printf ("  hook.batch.queue = 65536\n");
+		io->cb_printf ("  file.log.format = text\n");
+		io->cb_printf ("  file.log.flush  = 1000\n");
+		io->cb_printf ("  file.log.buffer = 65536\n");
+		io->cb_printf ("  file.log.rotate = 0\n");
+		io->cb_printf ("  reply.chunk     = 65536\n");
+		io->cb_printf ("  reply.file      = \n");
+		io->cb_printf ("  io.compress     = auto\n");
+		io->cb_printf ("  io.compress.min = 4096\n");
 	// fails to aim at seek workarounding hostCmd
 	} else if (!strncmp (command, "s  ", 3)) {
 		if (rf && rf->r2core) {
@@ -853,10 +1795,14 @@ static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 	}
 	free (slurpedData);
 
+	request_add_state (rf, builder);
 	result = perform_request (rf, builder, NULL, NULL);
 	if (!result) {
 		return NULL;
 	}
+	if (json_object_has_member (result, "stalker")) {
+		stalker_render (rf, json_object_get_object_member (result, "stalker"));
+	}
 
 	if (!json_object_has_member (result, "value")) {
 		return NULL;
@@ -867,10 +1813,17 @@ static char *__system_continuation(RIO *io, RIODesc *fd, const char *command) {
 		bool is_fs_io = command[0] == 'm';
 		if (is_fs_io) {
 			sys_result = strdup (value);
+		} else if (!strcmp (command, "?zj")) {
+			char *stats = host_stats_json (rf, value);
+			io->cb_printf ("%s\n", stats? stats: value);
+			g_free (stats);
 		} else {
 			io->cb_printf ("%s\n", value);
 		}
 	}
+	if (!strcmp (command, "?z")) {
+		host_stats_print (rf);
+	}
 	json_object_unref (result);
 
 	return sys_result;
@@ -1037,11 +1990,12 @@ static bool resolve2(RList *args, R2FridaLaunchOptions *lo, GCancellable *cancel
 	switch (action) {
 	case R2F_ACTION_LIST_APPS:
 		{
-		GError *error = NULL;
+		FridaDevice *device = NULL;
 		const char *devid = (R_STR_ISEMPTY (arg1))? NULL: arg1;
-		FridaDevice *device = get_device_manager (device_manager, devid, cancellable, &error); // frida_device_manager_get_device_by_type_sync (device_manager, devid, 0, cancellable, &error);
-		dumpApplications (device, cancellable);
-		g_object_unref (device);
+		if (resolve_device (device_manager, devid, &device, cancellable)) {
+			dumpApplications (device, cancellable);
+			g_object_unref (device);
+		}
 		}
 		return false;
 	case R2F_ACTION_LIST_PIDS:
@@ -1101,12 +2055,12 @@ static bool resolve4(RList *args, R2FridaLaunchOptions *lo, GCancellable *cancel
 	R2FridaAction action = parse_action (arg0);
 	R2FridaLink link = parse_link (arg1);
 
-	GError *error = NULL;
+	FridaDevice *device = NULL;
 	const char *devid = R_STR_ISEMPTY(arg1)? NULL: arg1;
 	if (link == R2F_LINK_REMOTE) {
 		devid = arg2;
 	}
-	FridaDevice *device = get_device_manager (device_manager, devid, cancellable, &error);
+	resolve_device (device_manager, devid, &device, cancellable);
 
 	// frida://attach/usb//
 	switch (action) {
@@ -1183,6 +2137,8 @@ static bool resolve_target(const char *pathname, R2FridaLaunchOptions *lo, GCanc
 		eprintf ("* frida://rax2                     # same as above, considering local/bin is in PATH\n");
 		eprintf ("* frida://spawn/$(program)         # spawn a new process in the current system\n");
 		eprintf ("* frida://attach/(target)          # attach to target PID in current host\n");
+		eprintf ("* frida://attach/local//123,456    # attach to several processes, see \\*?\n");
+		eprintf ("* frida://attach/local//~worker    # attach to every process with worker in its name\n");
 
 		eprintf ("USB:\n");
 		eprintf ("* frida://list/usb//               # list processes in the first usb device\n");
@@ -1197,6 +2153,13 @@ static bool resolve_target(const char *pathname, R2FridaLaunchOptions *lo, GCanc
 		eprintf ("  R2FRIDA_SAFE_IO                  # Workaround a Frida bug on Android/thumb\n");
 		eprintf ("  R2FRIDA_DEBUG                    # Used to debug argument parsing behaviour\n");
 		eprintf ("  R2FRIDA_AGENT_SCRIPT             # path to file of the r2frida agent\n");
+		eprintf ("  R2FRIDA_BYTECODE=0               # Do not cache the agent bytecode in ~/.cache/r2frida\n");
+		eprintf ("  R2FRIDA_TIMINGS                  # Print the time spent in each phase of the open and attach\n");
+		eprintf ("  R2FRIDA_COMPRESS=0               # Never compress the data sent by the agent\n");
+		eprintf ("  R2FRIDA_PROBE_TIMEOUT=5000       # Milliseconds to wait for a device to list its processes\n");
+		eprintf ("  R2FRIDA_DIRECT_IO                # Read and write the memory of local linux targets without the agent\n");
+		eprintf ("  R2FRIDA_SHM=64                   # Megabytes of the ring local agents send bulk data through\n");
+		eprintf ("  R2FRIDA_REUSE                    # Keep the session alive when closing, reopening the same uri reuses it\n");
 		return false;
 	}
 	lo->run = false;
@@ -1244,28 +2207,92 @@ static bool resolve_target(const char *pathname, R2FridaLaunchOptions *lo, GCanc
 	return res;
 }
 
+/* an unreachable remote can take minutes to fail, so the lookup is bounded by R2FRIDA_PROBE_TIMEOUT */
 static bool resolve_device(FridaDeviceManager *manager, const char *device_id, FridaDevice **device, GCancellable *cancellable) {
-	GError *error = NULL;
-	
-	*device = get_device_manager (manager, device_id, cancellable, &error);
-	if (error != NULL) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-			eprintf ("%s\n", error->message);
-		}
-		g_error_free (error);
+	RFProbe *probe = probe_new (RF_PROBE_RESOLVE, manager, NULL, device_id, cancellable);
+	probe_run (&probe, 1);
+	if (!probe || probe->error || probe->cancelled) {
+		probe_print (probe);
+		probe_free (probe);
+		*device = NULL;
 		return false;
 	}
+	*device = probe->device;
+	probe->device = NULL;
+	probe_free (probe);
 
 	return true;
 }
 
-static bool resolve_process(FridaDevice *device, R2FridaLaunchOptions *lo, GCancellable *cancellable) {
-	r_return_val_if_fail (device && lo, false);
+/* "1234,5678" lists pids, "~name" picks every process whose name contains name */
+static GArray *resolve_pids(FridaDevice *device, const char *spec, GCancellable *cancellable) {
+	if (!strcmp (spec, "~")) {
+		eprintf ("Missing process name after ~\n");
+		return NULL;
+	}
+	GArray *pids = g_array_new (FALSE, FALSE, sizeof (guint));
+	if (*spec == '~') {
+		GError *error = NULL;
+		FridaProcessList *list = frida_device_enumerate_processes_sync (device, cancellable, &error);
+		if (error) {
+			if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+				eprintf ("%s\n", error->message);
+			}
+			g_error_free (error);
+			g_array_free (pids, TRUE);
+			return NULL;
+		}
+		gint i, n = frida_process_list_size (list);
+		for (i = 0; i < n; i++) {
+			FridaProcess *process = frida_process_list_get (list, i);
+			if (strstr (frida_process_get_name (process), spec + 1)) {
+				guint pid = frida_process_get_pid (process);
+				g_array_append_val (pids, pid);
+			}
+			g_object_unref (process);
+		}
+		g_object_unref (list);
+	} else {
+		char **items = g_strsplit (spec, ",", -1);
+		char **item;
+		for (item = items; *item; item++) {
+			bool valid = false;
+			guint pid = atopid (*item, &valid);
+			if (!valid) {
+				eprintf ("Invalid pid '%s'\n", *item);
+				g_strfreev (items);
+				g_array_free (pids, TRUE);
+				return NULL;
+			}
+			g_array_append_val (pids, pid);
+		}
+		g_strfreev (items);
+	}
+	if (pids->len == 0) {
+		eprintf ("No process matches '%s'\n", spec + 1);
+		g_array_free (pids, TRUE);
+		return NULL;
+	}
+	return pids;
+}
+
+static bool resolve_process(FridaDevice *device, R2FridaLaunchOptions *lo, GCancellable *cancellable) {
+	r_return_val_if_fail (device && lo, false);
 	GError *error = NULL;
 
 	if (lo->pid_valid) {
 		return true;
 	}
+	if (lo->process_specifier && (*lo->process_specifier == '~' || strchr (lo->process_specifier, ','))) {
+		lo->pids = resolve_pids (device, lo->process_specifier, cancellable);
+		if (!lo->pids) {
+			return false;
+		}
+		lo->pid = g_array_index (lo->pids, guint, 0);
+		lo->pid_valid = true;
+		g_array_remove_index (lo->pids, 0);
+		return true;
+	}
 	if (lo->process_specifier) {
 		if (*lo->process_specifier) {
 			int number = atopid (lo->process_specifier, &lo->pid_valid);
@@ -1301,6 +2328,19 @@ static bool resolve_process(FridaDevice *device, R2FridaLaunchOptions *lo, GCanc
 	return true;
 }
 
+/* seek and suspended state travel with every command instead of in a request of their own */
+static void request_add_state(RIOFrida *rf, JsonBuilder *builder) {
+	char offstr[127] = {0};
+	json_builder_set_member_name (builder, "state");
+	json_builder_begin_object (builder);
+	json_builder_set_member_name (builder, "offset");
+	snprintf (offstr, sizeof (offstr), "0x%"PFMT64x, rf->io->off);
+	json_builder_add_string_value (builder, offstr);
+	json_builder_set_member_name (builder, "suspended");
+	json_builder_add_boolean_value (builder, rf->suspended);
+	json_builder_end_object (builder);
+}
+
 static JsonBuilder *build_request(const char *type) {
 	JsonBuilder *builder = json_builder_new ();
 	json_builder_begin_object (builder);
@@ -1312,9 +2352,14 @@ static JsonBuilder *build_request(const char *type) {
 }
 
 static JsonObject *perform_request(RIOFrida *rf, JsonBuilder *builder, GBytes *data, GBytes **bytes) {
+	if (!request_post (rf, builder, data)) {
+		return NULL;
+	}
+	return request_wait (rf, bytes);
+}
+
+static bool request_post(RIOFrida *rf, JsonBuilder *builder, GBytes *data) {
 	GError *error = NULL;
-	JsonObject *reply_stanza = NULL;
-	GBytes *reply_bytes = NULL;
 
 	json_builder_end_object (builder);
 	json_builder_end_object (builder);
@@ -1333,17 +2378,30 @@ static JsonObject *perform_request(RIOFrida *rf, JsonBuilder *builder, GBytes *d
 			eprintf ("error: %s\n", error->message);
 		}
 		g_error_free (error);
-		return NULL;
+		return false;
 	}
+	return true;
+}
+
+static JsonObject *request_wait(RIOFrida *rf, GBytes **bytes) {
+	JsonObject *reply_stanza = NULL;
+	GBytes *reply_bytes = NULL;
 
 	g_mutex_lock (&rf->lock);
 
 	exec_pending_cmd_if_needed (rf);
+	reply_chunks_flush (rf);
 
 	while (!rf->detached && !rf->received_reply) {
-		g_cond_wait (&rf->cond, &rf->lock);
+		// chunks queued while the previous ones were flushed unlocked already signalled
+		if (g_queue_is_empty (&rf->reply_chunks)) {
+			g_cond_wait (&rf->cond, &rf->lock);
+		}
 		exec_pending_cmd_if_needed (rf);
+		reply_chunks_flush (rf);
 	}
+	// chunks left behind by a stream that failed midway
+	reply_chunks_flush (rf);
 
 	if (rf->received_reply) {
 		reply_stanza = rf->reply_stanza;
@@ -1372,112 +2430,912 @@ static JsonObject *perform_request(RIOFrida *rf, JsonBuilder *builder, GBytes *d
 			eprintf ("Process replaced\n");
 			break;
 		}
-		return NULL;
+		return NULL;
+	}
+
+	if (json_object_has_member (reply_stanza, "error")) {
+		eprintf ("error: %s\n", json_object_get_string_member (reply_stanza, "error"));
+		json_object_unref (reply_stanza);
+		g_bytes_unref (reply_bytes);
+		return NULL;
+	}
+
+	if (bytes) {
+		*bytes = reply_bytes;
+	} else {
+		g_bytes_unref (reply_bytes);
+	}
+
+	return reply_stanza;
+}
+
+static void exec_pending_cmds(RIOFrida *rf) {
+	JsonArray *cmds = rf->pending_cmd->cmds;
+	JsonBuilder *builder = build_request ("cmd");
+	guint i;
+
+	json_builder_set_member_name (builder, "outputs");
+	json_builder_begin_array (builder);
+	for (i = 0; i < json_array_get_length (cmds); i++) {
+		const char *cmd = json_array_get_string_element (cmds, i);
+		char *output = cmd? rf->io->corebind.cmdstr (rf->r2core, cmd): NULL;
+		json_builder_add_string_value (builder, output? output: "");
+		free (output);
+	}
+	json_builder_end_array (builder);
+	json_builder_set_member_name (builder, "serial");
+	json_builder_add_int_value (builder, rf->pending_cmd->serial);
+
+	pending_cmd_free (rf->pending_cmd);
+	rf->pending_cmd = NULL;
+
+	perform_request_unlocked (rf, builder, NULL, NULL);
+}
+
+static void exec_pending_cmd_if_needed(RIOFrida * rf) {
+	if (!rf->pending_cmd) {
+		return;
+	}
+	if (rf->pending_cmd->cmds) {
+		exec_pending_cmds (rf);
+		return;
+	}
+	char *output = rf->io->corebind.cmdstr (rf->r2core, rf->pending_cmd->cmd_string);
+
+	ut64 serial = rf->pending_cmd->serial;
+	pending_cmd_free (rf->pending_cmd);
+	rf->pending_cmd = NULL;
+
+	if (output) {
+		JsonBuilder * builder = build_request ("cmd");
+		if (builder) {
+			json_builder_set_member_name (builder, "output");
+			json_builder_add_string_value (builder, output);
+			json_builder_set_member_name (builder, "serial");
+			json_builder_add_int_value (builder, serial);
+
+			perform_request_unlocked (rf, builder, NULL, NULL);
+		}
+		R_FREE (output);
+	}
+}
+
+static void perform_request_unlocked(RIOFrida *rf, JsonBuilder *builder, GBytes *data, GBytes **bytes) {
+	GError *error = NULL;
+
+	json_builder_end_object (builder);
+	json_builder_end_object (builder);
+	JsonNode *root = json_builder_get_root (builder);
+	char *message = json_to_string (root, FALSE);
+	json_node_unref (root);
+	g_object_unref (builder);
+
+	frida_script_post_sync (rf->script, message, data, rf->cancellable, &error);
+
+	g_free (message);
+	g_bytes_unref (data);
+
+	if (error) {
+		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			eprintf ("error: %s\n", error->message);
+		}
+		g_error_free (error);
+	}
+}
+
+static void reply_chunk_free(RFReplyChunk *chunk) {
+	g_free (chunk->file);
+	g_bytes_unref (chunk->data);
+	free (chunk);
+}
+
+// called from the frida thread, the chunk is written by the thread waiting in perform_request
+static void on_reply_chunk(RIOFrida *rf, JsonObject *stanza, GBytes *data) {
+	RFReplyChunk *chunk = R_NEW0 (RFReplyChunk);
+	if (!chunk) {
+		return;
+	}
+	chunk->stream = json_object_get_int_member (stanza, "stream");
+	chunk->file = g_strdup (json_object_get_string_member (stanza, "file"));
+	chunk->data = data? g_bytes_ref (data): NULL;
+
+	g_mutex_lock (&rf->lock);
+	g_queue_push_tail (&rf->reply_chunks, chunk);
+	g_cond_signal (&rf->cond);
+	g_mutex_unlock (&rf->lock);
+}
+
+/*
+ * called with rf->lock held, it is released while the chunks are written and acked: posting an ack
+ * waits for the frida thread, which needs the lock to queue the next chunk or the reply.
+ * every ack lets the agent send one more chunk
+ */
+static void reply_chunks_flush(RIOFrida *rf) {
+	GQueue chunks = G_QUEUE_INIT;
+	RFReplyChunk *chunk;
+	if (g_queue_is_empty (&rf->reply_chunks)) {
+		return;
+	}
+	while ((chunk = g_queue_pop_head (&rf->reply_chunks))) {
+		g_queue_push_tail (&chunks, chunk);
+	}
+	g_mutex_unlock (&rf->lock);
+	while ((chunk = g_queue_pop_head (&chunks))) {
+		gsize size = 0;
+		const char *buf = chunk->data? g_bytes_get_data (chunk->data, &size): NULL;
+		if (size > 0) {
+			if (rf->capture) {
+				g_string_append_len (rf->capture, buf, size);
+			} else if (R_STR_ISNOTEMPTY (chunk->file)) {
+				log_file_append (rf, NULL, chunk->file, buf, size);
+			} else {
+				rf->io->cb_printf ("%.*s", (int)size, buf);
+			}
+		}
+		JsonBuilder *builder = build_request ("chunk-ack");
+		json_builder_set_member_name (builder, "stream");
+		json_builder_add_int_value (builder, chunk->stream);
+		perform_request_unlocked (rf, builder, NULL, NULL);
+		reply_chunk_free (chunk);
+	}
+	g_mutex_lock (&rf->lock);
+}
+
+static void on_stanza(RIOFrida *rf, JsonObject *stanza, GBytes *bytes) {
+	g_mutex_lock (&rf->lock);
+
+	g_assert (!rf->reply_stanza && !rf->reply_bytes);
+
+	rf->received_reply = true;
+	rf->reply_stanza = stanza;
+	rf->reply_bytes = bytes? g_bytes_ref (bytes): NULL;
+	g_cond_signal (&rf->cond);
+
+	g_mutex_unlock (&rf->lock);
+}
+
+static void on_detached(FridaSession *session, FridaSessionDetachReason reason, FridaCrash *crash, gpointer user_data) {
+	RIOFrida *rf = user_data;
+	rf->detached = true;
+	rf->detach_reason = reason;
+	log_writers_flush (rf, true);
+	eprintf ("DetachReason: %s\n", detachReasonAsString (rf));
+	if (crash) {
+		const char *crash_report = frida_crash_get_report (crash);
+		free (rf->crash_report);
+		rf->crash_report = strdup (crash_report);
+		eprintf ("CrashReport: %s\n", crash_report);
+	}
+	g_mutex_lock (&rf->lock);
+	rf->crash = (crash != NULL) ? g_object_ref (crash) : NULL;
+	g_cond_signal (&rf->cond);
+	g_mutex_unlock (&rf->lock);
+}
+
+static void on_cmd(RIOFrida *rf, JsonObject *cmd_stanza) {
+	g_mutex_lock (&rf->lock);
+	g_assert (!rf->pending_cmd);
+	if (cmd_stanza) {
+		rf->pending_cmd = pending_cmd_create (cmd_stanza);
+	} else {
+		rf->pending_cmd = R_NEW0 (RFPendingCmd);
+	}
+	g_cond_signal (&rf->cond);
+	g_mutex_unlock (&rf->lock);
+}
+
+static void log_writer_free(RFLogWriter *w) {
+	if (!w) {
+		return;
+	}
+	if (w->fd) {
+		if (w->buf->len > 0) {
+			fwrite (w->buf->str, 1, w->buf->len, w->fd);
+		}
+		fclose (w->fd);
+	}
+	g_string_free (w->buf, TRUE);
+	free (w->filename);
+	free (w);
+}
+
+static bool log_writer_open(RFLogWriter *w) {
+	w->fd = fopen (w->filename, "ab");
+	if (!w->fd) {
+		eprintf ("Cannot open %s for writing\n", w->filename);
+		return false;
+	}
+	fseek (w->fd, 0, SEEK_END);
+	w->size = ftell (w->fd);
+	return true;
+}
+
+static void log_writer_flush(RFLogWriter *w) {
+	if (w->fd && w->buf->len > 0) {
+		fwrite (w->buf->str, 1, w->buf->len, w->fd);
+		fflush (w->fd);
+	}
+	g_string_truncate (w->buf, 0);
+	w->last_flush = g_get_monotonic_time ();
+}
+
+// file -> file.1 -> file.2 .. up to R2F_LOG_ROTATE_KEEP old files
+static void log_writer_rotate(RFLogWriter *w) {
+	int i;
+	log_writer_flush (w);
+	if (w->fd) {
+		fclose (w->fd);
+		w->fd = NULL;
+	}
+	for (i = R2F_LOG_ROTATE_KEEP - 1; i > 0; i--) {
+		char *from = r_str_newf ("%s.%d", w->filename, i);
+		char *to = r_str_newf ("%s.%d", w->filename, i + 1);
+		rename (from, to);
+		free (from);
+		free (to);
+	}
+	char *old = r_str_newf ("%s.1", w->filename);
+	rename (w->filename, old);
+	free (old);
+	log_writer_open (w);
+}
+
+static RFLogs *logs_new(void) {
+	RFLogs *logs = R_NEW0 (RFLogs);
+	logs->refs = 1;
+	g_mutex_init (&logs->lock);
+	logs->writers = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify)log_writer_free);
+	return logs;
+}
+
+static void logs_unref(gpointer user_data) {
+	RFLogs *logs = user_data;
+	if (g_atomic_int_dec_and_test (&logs->refs)) {
+		if (logs->writers) {
+			g_hash_table_unref (logs->writers);
+		}
+		g_mutex_clear (&logs->lock);
+		free (logs);
+	}
+}
+
+// must be called with logs->lock held
+static RFLogWriter *log_writer_get(RFLogs *logs, const char *filename) {
+	RFLogWriter *w = g_hash_table_lookup (logs->writers, filename);
+	if (w) {
+		return w;
+	}
+	w = R_NEW0 (RFLogWriter);
+	if (!w) {
+		return NULL;
+	}
+	w->filename = strdup (filename);
+	w->buf = g_string_sized_new (64 * 1024);
+	w->buffer_size = 64 * 1024;
+	w->flush_interval = G_TIME_SPAN_SECOND;
+	w->last_flush = g_get_monotonic_time ();
+	if (!log_writer_open (w)) {
+		log_writer_free (w);
+		return NULL;
+	}
+	g_hash_table_insert (logs->writers, w->filename, w);
+	if (!logs->timer) {
+		// runs on the frida main loop, so a quiet trace still reaches the file
+		logs->timer = g_timeout_source_new (R2F_LOG_TICK_MS);
+		g_atomic_int_inc (&logs->refs);
+		g_source_set_callback (logs->timer, log_writers_tick, logs, logs_unref);
+		g_source_attach (logs->timer, frida_get_main_context ());
+	}
+	return w;
+}
+
+static void log_writer_append(RFLogWriter *w, const char *data, gsize len) {
+	if (w->rotate_size && w->size + len > w->rotate_size && w->size > 0) {
+		log_writer_rotate (w);
+	}
+	g_string_append_len (w->buf, data, len);
+	w->size += len;
+	if (w->buf->len >= w->buffer_size || g_get_monotonic_time () - w->last_flush >= w->flush_interval) {
+		log_writer_flush (w);
+	}
+}
+
+// must be called with logs->lock held
+static void log_writers_flush_unlocked(RFLogs *logs, bool force) {
+	GHashTableIter iter;
+	gpointer value;
+	if (logs->writers) {
+		const gint64 now = g_get_monotonic_time ();
+		g_hash_table_iter_init (&iter, logs->writers);
+		while (g_hash_table_iter_next (&iter, NULL, &value)) {
+			RFLogWriter *w = value;
+			if (force || now - w->last_flush >= w->flush_interval) {
+				log_writer_flush (w);
+			}
+		}
+	}
+}
+
+static void log_writers_flush(RIOFrida *rf, bool force) {
+	RFLogs *logs = rf->logs;
+	if (logs) {
+		g_mutex_lock (&logs->lock);
+		log_writers_flush_unlocked (logs, force);
+		g_mutex_unlock (&logs->lock);
+	}
+}
+
+// the source holds its own reference, so it never touches rf
+static gboolean log_writers_tick(gpointer user_data) {
+	RFLogs *logs = user_data;
+	g_mutex_lock (&logs->lock);
+	const bool stopped = !logs->writers;
+	if (!stopped) {
+		log_writers_flush_unlocked (logs, false);
+	}
+	g_mutex_unlock (&logs->lock);
+	return stopped? G_SOURCE_REMOVE: G_SOURCE_CONTINUE;
+}
+
+// the writers are closed right away, the state itself goes with the last reference
+static void log_writers_free(RIOFrida *rf) {
+	RFLogs *logs = rf->logs;
+	if (!logs) {
+		return;
+	}
+	rf->logs = NULL;
+	g_mutex_lock (&logs->lock);
+	if (logs->timer) {
+		g_source_destroy (logs->timer);
+		g_source_unref (logs->timer);
+		logs->timer = NULL;
+	}
+	g_hash_table_unref (logs->writers);
+	logs->writers = NULL;
+	g_mutex_unlock (&logs->lock);
+	logs_unref (logs);
+}
+
+static void log_file_append(RIOFrida *rf, JsonObject *stanza, const char *filename, const char *data, gsize len) {
+	RFLogs *logs = rf->logs;
+	if (!logs) {
+		return;
+	}
+	g_mutex_lock (&logs->lock);
+	RFLogWriter *w = log_writer_get (logs, filename);
+	if (w) {
+		if (stanza && json_object_has_member (stanza, "flush")) {
+			w->flush_interval = json_object_get_int_member (stanza, "flush") * G_TIME_SPAN_MILLISECOND;
+			w->buffer_size = json_object_get_int_member (stanza, "buffer");
+			w->rotate_size = json_object_get_int_member (stanza, "rotate");
+		}
+		log_writer_append (w, data, len);
+	}
+	g_mutex_unlock (&logs->lock);
+}
+
+static void on_log_batch(RIOFrida *rf, JsonObject *stanza, GBytes *data) {
+	if (!data) {
+		return;
+	}
+	gsize size = 0;
+	gsize off = 0;
+	const ut8 *buf = g_bytes_get_data (data, &size);
+	GString *console = g_string_new (NULL);
+	GString *file = g_string_new (NULL);
+	// [u8 kind][u32le length][message] records, see src/agent/batch.js
+	while (off + 5 <= size) {
+		const ut8 kind = buf[off];
+		const ut32 len = r_read_le32 (buf + off + 1);
+		off += 5;
+		if (len > size - off) {
+			eprintf ("Truncated trace batch\n");
+			break;
+		}
+		GString *out = (kind == RF_BATCH_LOG_FILE)? file: console;
+		g_string_append_len (out, (const char *)buf + off, len);
+		g_string_append_c (out, '\n');
+		off += len;
+	}
+	if (console->len > 0) {
+		eprintf ("%s", console->str);
+	}
+	const char *filename = json_object_get_string_member (stanza, "filename");
+	if (file->len > 0 && R_STR_ISNOTEMPTY (filename)) {
+		log_file_append (rf, stanza, filename, file->str, file->len);
+	}
+	g_string_free (console, TRUE);
+	g_string_free (file, TRUE);
+
+	gint64 dropped = json_object_get_int_member (stanza, "dropped");
+	if (dropped > rf->batch_dropped) {
+		eprintf ("Warning: the agent dropped %"PFMT64d" trace events, see \\dtls\n", (st64)(dropped - rf->batch_dropped));
+		rf->batch_dropped = dropped;
+	}
+}
+
+static void stalker_trace_free(RFStalkerTrace *st) {
+	if (!st) {
+		return;
+	}
+	g_hash_table_unref (st->threads);
+	g_array_free (st->ranges, TRUE);
+	free (st->event);
+	free (st->file);
+	free (st);
+}
+
+static void on_stalker_start(RIOFrida *rf, JsonObject *stanza) {
+	RFStalkerTrace *st = R_NEW0 (RFStalkerTrace);
+	if (!st) {
+		return;
+	}
+	st->session = json_object_get_int_member (stanza, "session");
+	st->pointer_size = json_object_get_int_member (stanza, "pointerSize");
+	st->event = strdup (json_object_get_string_member (stanza, "event"));
+	const char *file = json_object_get_string_member (stanza, "file");
+	st->file = R_STR_ISNOTEMPTY (file)? strdup (file): NULL;
+	st->ranges = g_array_new (FALSE, FALSE, sizeof (ut64));
+	st->threads = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_array_unref);
+	JsonArray *ranges = json_object_get_array_member (stanza, "ranges");
+	guint i, n = ranges? json_array_get_length (ranges): 0;
+	for (i = 0; i < n; i++) {
+		JsonArray *range = json_array_get_array_element (ranges, i);
+		ut64 start = strtoull (json_array_get_string_element (range, 0), NULL, 0);
+		ut64 end = strtoull (json_array_get_string_element (range, 1), NULL, 0);
+		g_array_append_val (st->ranges, start);
+		g_array_append_val (st->ranges, end);
+	}
+	// the agent picks the id, the table owns a copy of it so a reused id frees the old trace cleanly
+	gint64 *key = g_new (gint64, 1);
+	*key = st->session;
+	g_mutex_lock (&rf->stalker_lock);
+	if (!rf->stalker_traces) {
+		rf->stalker_traces = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)stalker_trace_free);
+	}
+	g_hash_table_replace (rf->stalker_traces, key, st);
+	g_mutex_unlock (&rf->stalker_lock);
+}
+
+static bool stalker_in_ranges(RFStalkerTrace *st, ut64 addr) {
+	guint i;
+	if (st->ranges->len == 0) {
+		return true;
+	}
+	for (i = 0; i + 1 < st->ranges->len; i += 2) {
+		if (addr >= g_array_index (st->ranges, ut64, i) && addr < g_array_index (st->ranges, ut64, i + 1)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static ut64 stalker_read_ptr(const ut8 *p, int pointer_size) {
+	return (pointer_size == 8)? r_read_le64 (p): r_read_le32 (p);
+}
+
+static const char *stalker_event_name(ut32 type) {
+	switch (type) {
+	case R2F_GUM_CALL: return "call";
+	case R2F_GUM_RET: return "ret";
+	case R2F_GUM_EXEC: return "exec";
+	case R2F_GUM_BLOCK: return "block";
+	case R2F_GUM_COMPILE: return "compile";
+	}
+	return "unknown";
+}
+
+// every GumEvent takes four pointer-sized words: type, then up to three fields
+static void on_stalker_events(RIOFrida *rf, JsonObject *stanza, GBytes *data) {
+	gsize size = 0;
+	gsize off;
+	if (!data) {
+		return;
+	}
+	const ut8 *buf = g_bytes_get_data (data, &size);
+	const gint64 tid = json_object_get_int_member (stanza, "tid");
+	const gint64 session = json_object_get_int_member (stanza, "session");
+	g_mutex_lock (&rf->stalker_lock);
+	RFStalkerTrace *st = rf->stalker_traces? g_hash_table_lookup (rf->stalker_traces, &session): NULL;
+	if (!st) {
+		g_mutex_unlock (&rf->stalker_lock);
+		return;
+	}
+	const int ps = st->pointer_size;
+	GString *out = st->file? g_string_new (NULL): NULL;
+	GArray *events = NULL;
+	if (!out) {
+		events = g_hash_table_lookup (st->threads, GINT_TO_POINTER (tid));
+		if (!events) {
+			events = g_array_new (FALSE, FALSE, sizeof (RFStalkerEvent));
+			g_hash_table_insert (st->threads, GINT_TO_POINTER (tid), events);
+		}
+	}
+	for (off = 0; off + 4 * ps <= size; off += 4 * ps) {
+		const ut8 *p = buf + off;
+		RFStalkerEvent ev = {0};
+		ev.type = r_read_le32 (p);
+		ev.a = stalker_read_ptr (p + ps, ps);
+		switch (ev.type) {
+		case R2F_GUM_CALL:
+		case R2F_GUM_RET:
+			ev.b = stalker_read_ptr (p + 2 * ps, ps);
+			ev.depth = (st32)r_read_le32 (p + 3 * ps);
+			break;
+		case R2F_GUM_BLOCK:
+		case R2F_GUM_COMPILE:
+			ev.b = stalker_read_ptr (p + 2 * ps, ps);
+			break;
+		}
+		st->received++;
+		if (!stalker_in_ranges (st, ev.a)) {
+			st->filtered++;
+			continue;
+		}
+		if (out) {
+			g_string_append_printf (out, "%"PFMT64d" %s 0x%"PFMT64x" 0x%"PFMT64x" %d\n",
+				(st64)tid, stalker_event_name (ev.type), ev.a, ev.b, ev.depth);
+		} else if (st->kept < R2F_STALKER_MAX_EVENTS) {
+			g_array_append_val (events, ev);
+			st->kept++;
+		} else {
+			st->dropped++;
+		}
+	}
+	if (out) {
+		if (out->len > 0) {
+			log_file_append (rf, NULL, st->file, out->str, out->len);
+		}
+		g_string_free (out, TRUE);
+	}
+	g_mutex_unlock (&rf->stalker_lock);
+}
+
+static bool stalker_is_block(RFStalkerEvent *ev) {
+	return ev->type == R2F_GUM_BLOCK || ev->type == R2F_GUM_COMPILE;
+}
+
+// a cancelled stalker job, its trace will never be rendered
+static void on_stalker_drop(RIOFrida *rf, JsonObject *stanza) {
+	gint64 session = json_object_get_int_member (stanza, "session");
+	g_mutex_lock (&rf->stalker_lock);
+	if (rf->stalker_traces) {
+		g_hash_table_remove (rf->stalker_traces, &session);
+	}
+	g_mutex_unlock (&rf->stalker_lock);
+}
+
+/* r2 flags first, the agent names the targets r2 knows nothing about */
+static const char *stalker_symbol(RIOFrida *rf, GHashTable *names, ut64 addr) {
+	RFlagItem *fi = r_flag_get_i (rf->r2core->flags, addr);
+	if (fi) {
+		return fi->name;
+	}
+	const char *name = names? g_hash_table_lookup (names, &addr): NULL;
+	return name? name: "";
+}
+
+// one request for all the call targets without a flag, instead of one per event
+static GHashTable *stalker_symbolicate(RIOFrida *rf, RFStalkerTrace *st) {
+	GHashTableIter iter;
+	gpointer value;
+	guint i;
+	GHashTable *names = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+	GArray *addrs = g_array_new (FALSE, FALSE, sizeof (ut64));
+	g_hash_table_iter_init (&iter, st->threads);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		GArray *events = value;
+		for (i = 0; i < events->len; i++) {
+			RFStalkerEvent *ev = &g_array_index (events, RFStalkerEvent, i);
+			if (!ev->b || stalker_is_block (ev) || g_hash_table_contains (names, &ev->b)
+					|| r_flag_get_i (rf->r2core->flags, ev->b)) {
+				continue;
+			}
+			g_hash_table_insert (names, g_memdup (&ev->b, sizeof (ut64)), NULL);
+			g_array_append_val (addrs, ev->b);
+		}
+	}
+	if (addrs->len > 0) {
+		char addr[32];
+		JsonBuilder *builder = build_request ("symbolicate");
+		json_builder_set_member_name (builder, "addresses");
+		json_builder_begin_array (builder);
+		for (i = 0; i < addrs->len; i++) {
+			snprintf (addr, sizeof (addr), "0x%"PFMT64x, g_array_index (addrs, ut64, i));
+			json_builder_add_string_value (builder, addr);
+		}
+		json_builder_end_array (builder);
+		JsonObject *result = perform_request (rf, builder, NULL, NULL);
+		JsonArray *list = (result && json_object_has_member (result, "names"))
+			? json_object_get_array_member (result, "names"): NULL;
+		for (i = 0; list && i < addrs->len && i < json_array_get_length (list); i++) {
+			const char *name = json_array_get_string_element (list, i);
+			if (R_STR_ISNOTEMPTY (name)) {
+				g_hash_table_replace (names, g_memdup (&g_array_index (addrs, ut64, i), sizeof (ut64)), strdup (name));
+			}
+		}
+		if (result) {
+			json_object_unref (result);
+		}
+	}
+	g_array_free (addrs, TRUE);
+	return names;
+}
+
+static void stalker_render_json(RIOFrida *rf, RFStalkerTrace *st, JsonArray *tids) {
+	guint i, j;
+	bool first = true;
+	GString *out = g_string_new (NULL);
+	g_string_append_printf (out, "{\"event\":\"%s\",\"threads\":{", st->event);
+	for (i = 0; i < json_array_get_length (tids); i++) {
+		const gint64 tid = json_array_get_int_element (tids, i);
+		GArray *events = g_hash_table_lookup (st->threads, GINT_TO_POINTER (tid));
+		if (!events) {
+			continue;
+		}
+		g_string_append_printf (out, "%s\"%"PFMT64d"\":[", first? "": ",", (st64)tid);
+		first = false;
+		for (j = 0; j < events->len; j++) {
+			RFStalkerEvent *ev = &g_array_index (events, RFStalkerEvent, j);
+			const char *comma = j? ",": "";
+			if (ev->type == R2F_GUM_CALL || ev->type == R2F_GUM_RET) {
+				g_string_append_printf (out, "%s[\"0x%"PFMT64x"\",\"0x%"PFMT64x"\",%d]", comma, ev->a, ev->b, ev->depth);
+			} else if (stalker_is_block (ev)) {
+				g_string_append_printf (out, "%s[\"0x%"PFMT64x"\",\"0x%"PFMT64x"\"]", comma, ev->a, ev->b);
+			} else {
+				g_string_append_printf (out, "%s[\"0x%"PFMT64x"\"]", comma, ev->a);
+			}
+		}
+		g_string_append_c (out, ']');
 	}
+	g_string_append (out, "}}");
+	rf->io->cb_printf ("%s\n", out->str);
+	g_string_free (out, TRUE);
+}
 
-	if (json_object_has_member (reply_stanza, "error")) {
-		eprintf ("error: %s\n", json_object_get_string_member (reply_stanza, "error"));
-		json_object_unref (reply_stanza);
-		g_bytes_unref (reply_bytes);
-		return NULL;
+// one "dt+ addr 1" per instruction executed by the block
+static void stalker_render_block_r2(RIOFrida *rf, RFStalkerEvent *ev) {
+	guint i;
+	char *res = r_core_cmd_strf (rf->r2core, "pDj %"PFMT64d" @ 0x%"PFMT64x, ev->b - ev->a, ev->a);
+	JsonNode *node = res? json_from_string (res, NULL): NULL;
+	if (node && json_node_get_node_type (node) == JSON_NODE_ARRAY) {
+		JsonArray *ops = json_node_get_array (node);
+		for (i = 0; i < json_array_get_length (ops); i++) {
+			JsonObject *op = json_array_get_object_element (ops, i);
+			rf->io->cb_printf ("dt+ 0x%"PFMT64x" 1\n", (ut64)json_object_get_int_member (op, "offset"));
+		}
 	}
-
-	if (bytes) {
-		*bytes = reply_bytes;
-	} else {
-		g_bytes_unref (reply_bytes);
+	if (node) {
+		json_node_unref (node);
 	}
+	free (res);
+}
 
-	return reply_stanza;
+static void stalker_render_events(RIOFrida *rf, GArray *events, bool r2mode, GHashTable *names) {
+	guint i;
+	for (i = 0; i < events->len; i++) {
+		RFStalkerEvent *ev = &g_array_index (events, RFStalkerEvent, i);
+		if (stalker_is_block (ev)) {
+			if (r2mode) {
+				stalker_render_block_r2 (rf, ev);
+			} else {
+				char *pd = r_core_cmd_strf (rf->r2core, "pD %"PFMT64d" @ 0x%"PFMT64x, ev->b - ev->a, ev->a);
+				rf->io->cb_printf ("%s", r_str_get (pd));
+				free (pd);
+			}
+		} else if (r2mode) {
+			rf->io->cb_printf ("dt+ 0x%"PFMT64x" 1\n", ev->a);
+			if (ev->b) {
+				rf->io->cb_printf ("CC 0x%"PFMT64x" %s @ 0x%"PFMT64x"\n", ev->b, stalker_symbol (rf, names, ev->b), ev->a);
+			}
+		} else {
+			char *pd = r_core_cmd_strf (rf->r2core, "pd 1 @ 0x%"PFMT64x, ev->a);
+			if (pd) {
+				r_str_trim (pd);
+			}
+			if (ev->b) {
+				rf->io->cb_printf ("%s ; 0x%"PFMT64x" %s\n", r_str_get (pd), ev->b, stalker_symbol (rf, names, ev->b));
+			} else {
+				rf->io->cb_printf ("%s\n", r_str_get (pd));
+			}
+			free (pd);
+		}
+	}
 }
 
-static void exec_pending_cmd_if_needed(RIOFrida * rf) {
-	if (!rf->pending_cmd) {
+// per thread counters from the agent, a full drain means the stalker dropped events
+static void stalker_render_stats(JsonObject *done) {
+	JsonObject *stats = json_object_has_member (done, "stats")? json_object_get_object_member (done, "stats"): NULL;
+	if (!stats) {
 		return;
 	}
-	char *output = rf->io->corebind.cmdstr (rf->r2core, rf->pending_cmd->cmd_string);
-
-	ut64 serial = rf->pending_cmd->serial;
-	pending_cmd_free (rf->pending_cmd);
-	rf->pending_cmd = NULL;
-
-	if (output) {
-		JsonBuilder * builder = build_request ("cmd");
-		if (builder) {
-			json_builder_set_member_name (builder, "output");
-			json_builder_add_string_value (builder, output);
-			json_builder_set_member_name (builder, "serial");
-			json_builder_add_int_value (builder, serial);
+	GList *tids = json_object_get_members (stats);
+	GList *iter;
+	for (iter = tids; iter; iter = iter->next) {
+		const char *tid = iter->data;
+		JsonObject *st = json_object_get_object_member (stats, tid);
+		const gint64 full = json_object_get_int_member (st, "full");
+		eprintf ("thread %s: %"PFMT64d" events in %"PFMT64d" drains%s\n", tid,
+			(st64)json_object_get_int_member (st, "events"),
+			(st64)json_object_get_int_member (st, "drains"),
+			full? ", some were dropped (see stalker.queue.capacity)": "");
+	}
+	g_list_free (tids);
+}
 
-			perform_request_unlocked (rf, builder, NULL, NULL);
+// runs on the main thread with the "stalker" member of a reply, events were decoded as they arrived
+static void stalker_render(RIOFrida *rf, JsonObject *done) {
+	guint i;
+	gint64 session = json_object_get_int_member (done, "session");
+	RFStalkerTrace *st = NULL;
+	gpointer key = NULL;
+	g_mutex_lock (&rf->stalker_lock);
+	if (rf->stalker_traces && g_hash_table_steal_extended (rf->stalker_traces, &session, &key, (gpointer *)&st)) {
+		g_free (key);
+	}
+	g_mutex_unlock (&rf->stalker_lock);
+	if (!st) {
+		return;
+	}
+	const char *mode = json_object_get_string_member (done, "mode");
+	JsonArray *tids = json_object_get_array_member (done, "threads");
+	if (st->file) {
+		log_writers_flush (rf, true);
+		eprintf ("%"PFMT64u" events written to %s, %"PFMT64u" out of stalker.in\n",
+			st->received - st->filtered, st->file, st->filtered);
+	} else if (tids && !strcmp (mode, "json")) {
+		stalker_render_json (rf, st, tids);
+	} else if (tids) {
+		const bool r2mode = !strcmp (mode, "r2");
+		GHashTable *names = stalker_symbolicate (rf, st);
+		for (i = 0; i < json_array_get_length (tids); i++) {
+			const gint64 tid = json_array_get_int_element (tids, i);
+			GArray *events = g_hash_table_lookup (st->threads, GINT_TO_POINTER (tid));
+			if (!events) {
+				continue;
+			}
+			if (!r2mode) {
+				rf->io->cb_printf ("; --- thread %"PFMT64d" --- ;\n", (st64)tid);
+			}
+			stalker_render_events (rf, events, r2mode, names);
 		}
-		R_FREE (output);
+		g_hash_table_unref (names);
+	}
+	if (st->dropped) {
+		eprintf ("%"PFMT64u" events dropped after the first %d, use stalker.file for longer traces\n",
+			st->dropped, R2F_STALKER_MAX_EVENTS);
 	}
+	stalker_render_stats (done);
+	stalker_trace_free (st);
 }
 
-static void perform_request_unlocked(RIOFrida *rf, JsonBuilder *builder, GBytes *data, GBytes **bytes) {
-	GError *error = NULL;
-
-	json_builder_end_object (builder);
-	json_builder_end_object (builder);
-	JsonNode *root = json_builder_get_root (builder);
-	char *message = json_to_string (root, FALSE);
-	json_node_unref (root);
-	g_object_unref (builder);
-
-	frida_script_post_sync (rf->script, message, data, rf->cancellable, &error);
-
-	g_free (message);
-	g_bytes_unref (data);
-
-	if (error) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-			eprintf ("error: %s\n", error->message);
-		}
-		g_error_free (error);
+// binary files produced by the agent, like the \dtcd drcov export
+static void on_dump_file(RIOFrida *rf, JsonObject *stanza, GBytes *data) {
+	gsize size = 0;
+	const char *filename = json_object_get_string_member (stanza, "filename");
+	const ut8 *buf = data? g_bytes_get_data (data, &size): NULL;
+	if (R_STR_ISEMPTY (filename)) {
+		return;
+	}
+	FILE *fd = fopen (filename, "wb");
+	if (!fd) {
+		eprintf ("Cannot open %s for writing\n", filename);
+		return;
+	}
+	if (size > 0 && fwrite (buf, 1, size, fd) != size) {
+		eprintf ("Cannot write %s\n", filename);
 	}
+	fclose (fd);
 }
 
-static void on_stanza(RIOFrida *rf, JsonObject *stanza, GBytes *bytes) {
-	g_mutex_lock (&rf->lock);
-
-	g_assert (!rf->reply_stanza && !rf->reply_bytes);
-
-	rf->received_reply = true;
-	rf->reply_stanza = stanza;
-	rf->reply_bytes = bytes? g_bytes_ref (bytes): NULL;
-	g_cond_signal (&rf->cond);
+static bool lz4_read_length(const ut8 **ip, const ut8 *iend, gsize *len) {
+	ut8 b;
+	do {
+		if (*ip >= iend) {
+			return false;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
 
-	g_mutex_unlock (&rf->lock);
+// lz4 block format, see r2f_lz4_compress in src/agent/wire.js
+static bool lz4_decompress(const ut8 *src, gsize srclen, ut8 *dst, gsize dstlen) {
+	const ut8 *ip = src;
+	const ut8 *iend = src + srclen;
+	ut8 *op = dst;
+	ut8 *oend = dst + dstlen;
+	while (ip < iend) {
+		const ut8 token = *ip++;
+		gsize len = token >> 4;
+		if (len == 15 && !lz4_read_length (&ip, iend, &len)) {
+			return false;
+		}
+		if (len > (gsize)(iend - ip) || len > (gsize)(oend - op)) {
+			return false;
+		}
+		memcpy (op, ip, len);
+		op += len;
+		ip += len;
+		if (ip >= iend) {
+			break;
+		}
+		if (iend - ip < 2) {
+			return false;
+		}
+		const gsize offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (gsize)(op - dst)) {
+			return false;
+		}
+		len = token & 15;
+		if (len == 15 && !lz4_read_length (&ip, iend, &len)) {
+			return false;
+		}
+		len += 4;
+		if (len > (gsize)(oend - op)) {
+			return false;
+		}
+		// the match may overlap the bytes being written
+		const ut8 *match = op - offset;
+		while (len--) {
+			*op++ = *match++;
+		}
+	}
+	return op == oend;
 }
 
-static void on_detached(FridaSession *session, FridaSessionDetachReason reason, FridaCrash *crash, gpointer user_data) {
-	RIOFrida *rf = user_data;
-	rf->detached = true;
-	rf->detach_reason = reason;
-	eprintf ("DetachReason: %s\n", detachReasonAsString (rf));
-	if (crash) {
-		const char *crash_report = frida_crash_get_report (crash);
-		free (rf->crash_report);
-		rf->crash_report = strdup (crash_report);
-		eprintf ("CrashReport: %s\n", crash_report);
+// the agent sends larger messages uncompressed, see maxPacked in wire.js
+#define R2F_WIRE_MAX_UNPACKED (256 << 20)
+// an lz4 sequence cannot expand more than this
+#define R2F_LZ4_MAX_RATIO 255
+
+static GBytes *wire_unpack(RIOFrida *rf, JsonObject *payload, GBytes *data) {
+	const char *codec = json_object_get_string_member (payload, "codec");
+	const gint64 declared = json_object_get_int_member (payload, "size");
+	gsize packed = 0;
+	const ut8 *buf = data? g_bytes_get_data (data, &packed): NULL;
+	if (!buf || !codec || strcmp (codec, "lz4")) {
+		return NULL;
 	}
-	g_mutex_lock (&rf->lock);
-	rf->crash = (crash != NULL) ? g_object_ref (crash) : NULL;
-	g_cond_signal (&rf->cond);
-	g_mutex_unlock (&rf->lock);
+	// the size comes from the target, do not let it pick the allocation
+	if (declared < 0 || declared > R2F_WIRE_MAX_UNPACKED || (ut64)declared > (ut64)packed * R2F_LZ4_MAX_RATIO + 16) {
+		return NULL;
+	}
+	const gsize size = declared;
+	ut8 *out = g_malloc (size? size: 1);
+	const gint64 start = g_get_monotonic_time ();
+	if (!lz4_decompress (buf, packed, out, size)) {
+		g_free (out);
+		return NULL;
+	}
+	rf->wire.messages++;
+	rf->wire.packed += packed;
+	rf->wire.unpacked += size;
+	rf->wire.usec += g_get_monotonic_time () - start;
+	return g_bytes_new_take (out, size);
 }
 
-static void on_cmd(RIOFrida *rf, JsonObject *cmd_stanza) {
-	g_mutex_lock (&rf->lock);
-	g_assert (!rf->pending_cmd);
-	if (cmd_stanza) {
-		rf->pending_cmd = pending_cmd_create (cmd_stanza);
-	} else {
-		rf->pending_cmd = R_NEW0 (RFPendingCmd);
+/* copies the payload out of the ring and hands its room back to the agent */
+static GBytes *shm_unpack(RIOFrida *rf, JsonObject *payload) {
+	JsonObject *shm = json_object_get_object_member (payload, "shm");
+	const gint64 offset = json_object_get_int_member (shm, "offset");
+	const gint64 size = json_object_get_int_member (shm, "size");
+	const gint64 next = json_object_get_int_member (shm, "next");
+	// the target writes these, they must not point outside the mapping
+	if (!rf->shm.base || offset < 0 || size < 0 || next < 0) {
+		return NULL;
 	}
-	g_cond_signal (&rf->cond);
-	g_mutex_unlock (&rf->lock);
+	const ut64 cap = rf->shm.size - R2F_SHM_HEADER;
+	if ((ut64)offset > cap || (ut64)size > cap - (ut64)offset) {
+		return NULL;
+	}
+	GBytes *bytes = g_bytes_new (rf->shm.base + R2F_SHM_HEADER + offset, size);
+	__atomic_store_n ((ut64 *)rf->shm.base, (ut64)next, __ATOMIC_RELEASE);
+	rf->shm.messages++;
+	rf->shm.bytes += size;
+	return bytes;
 }
 
 static void on_message(FridaScript *script, const char *raw_message, GBytes *data, gpointer user_data) {
@@ -1495,6 +3353,20 @@ static void on_message(FridaScript *script, const char *raw_message, GBytes *dat
 		JsonNodeType type = json_node_get_node_type (payload_node);
 		if (type == JSON_NODE_OBJECT) {
 			JsonObject *payload = json_object_ref (json_object_get_object_member (root, "payload"));
+			GBytes *unpacked = NULL;
+			if (payload && json_object_has_member (payload, "codec")) {
+				unpacked = wire_unpack (rf, payload, data);
+				if (!unpacked) {
+					eprintf ("Cannot decompress the data of '%s'\n", json_object_get_string_member (payload, "name"));
+				}
+				data = unpacked;
+			} else if (payload && json_object_has_member (payload, "shm")) {
+				unpacked = shm_unpack (rf, payload);
+				if (!unpacked) {
+					eprintf ("Cannot find the data of '%s' in the shared ring\n", json_object_get_string_member (payload, "name"));
+				}
+				data = unpacked;
+			}
 			if (payload && json_object_has_member (payload, "stanza")) {
 				JsonObject *stanza = json_object_get_object_member (payload, "stanza");
 				const char *name = json_object_get_string_member (payload, "name");
@@ -1510,6 +3382,10 @@ static void on_message(FridaScript *script, const char *raw_message, GBytes *dat
 					} else {
 						eprintf ("Bug in the agent, expected an object: %s\n", raw_message);
 					}
+				} else if (name && !strcmp (name, "reply-chunk")) {
+					if (stanza) {
+						on_reply_chunk (rf, stanza, data);
+					}
 				} else if (name && !strcmp (name, "cmd")) {
 					on_cmd (rf, json_object_get_object_member (payload, "stanza"));
 				} else if (name && !strcmp (name, "log")) {
@@ -1525,6 +3401,33 @@ static void on_message(FridaScript *script, const char *raw_message, GBytes *dat
 							free (message);
 						}
 					}
+				} else if (name && !strcmp (name, "log-batch")) {
+					if (stanza) {
+						on_log_batch (rf, stanza, data);
+					}
+				} else if (name && !strcmp (name, "stalker-start")) {
+					if (stanza) {
+						on_stalker_start (rf, stanza);
+					}
+				} else if (name && !strcmp (name, "stalker-events")) {
+					if (stanza) {
+						on_stalker_events (rf, stanza, data);
+					}
+				} else if (name && !strcmp (name, "stalker-drop")) {
+					if (stanza) {
+						on_stalker_drop (rf, stanza);
+					}
+				} else if (name && !strcmp (name, "job-done")) {
+					if (stanza) {
+						eprintf ("Job %"PFMT64d" %s: %s\n",
+							(st64)json_object_get_int_member (stanza, "id"),
+							json_object_get_string_member (stanza, "status"),
+							json_object_get_string_member (stanza, "command"));
+					}
+				} else if (name && !strcmp (name, "dump-file")) {
+					if (stanza) {
+						on_dump_file (rf, stanza, data);
+					}
 				} else if (name && !strcmp (name, "log-file")) {
 					JsonNode *stanza_node = json_object_get_member (payload, "stanza");
 					if (stanza) {
@@ -1536,7 +3439,7 @@ static void on_message(FridaScript *script, const char *raw_message, GBytes *dat
 							: strdup (json_object_get_string_member (stanza, "message"));
 						message = r_str_append (message, "\n");
 						if (filename && message) {
-							(void) r_file_dump (filename, (const ut8*)message, -1, true);
+							log_file_append (rf, NULL, filename, message, strlen (message));
 						}
 						free (message);
 						// json_node_unref (stanza_node);
@@ -1550,6 +3453,9 @@ static void on_message(FridaScript *script, const char *raw_message, GBytes *dat
 			} else {
 				eprintf ("Unexpected payload\n");
 			}
+			if (unpacked) {
+				g_bytes_unref (unpacked);
+			}
 		} else {
 			eprintf ("Bug in the agent, expected an object: %s\n", raw_message);
 		}
@@ -1568,28 +3474,17 @@ static void on_message(FridaScript *script, const char *raw_message, GBytes *dat
 	json_node_unref (message);
 }
 
-static void dumpDevices(GCancellable *cancellable) {
-	if (r2f_debug ()) {
-		printf ("dump-devices\n");
-		return;
-	}
-	GString *dump;
+/* runs in a probe thread, the table is appended to dump */
+static int appendDevices(FridaDeviceManager *manager, GCancellable *cancellable, GString *dump, GError **error) {
 	FridaDeviceList *list;
 	GArray *devices;
 	gint num_devices, i;
-	GError *error;
 	guint id_column_width, type_column_width, name_column_width;
 	GEnumClass *type_enum;
 
-	dump = g_string_sized_new (256);
-
-	error = NULL;
-	list = frida_device_manager_enumerate_devices_sync (device_manager, cancellable, &error);
-	if (error) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-			eprintf ("error: %s\n", error->message);
-		}
-		goto beach;
+	list = frida_device_manager_enumerate_devices_sync (manager, cancellable, error);
+	if (!list) {
+		return 0;
 	}
 	num_devices = frida_device_list_size (list);
 
@@ -1645,41 +3540,23 @@ static void dumpDevices(GCancellable *cancellable) {
 			frida_device_get_name (device));
 	}
 
-	r_cons_printf ("%s\n", dump->str);
-
 	g_type_class_unref (type_enum);
+	g_array_free (devices, TRUE);
+	g_object_unref (list);
 
-beach:
-	g_clear_error (&error);
-	g_clear_object (&list);
-
-	g_string_free (dump, TRUE);
+	return num_devices;
 }
 
-static int dumpApplications(FridaDevice *device, GCancellable *cancellable) {
-	GString *dump;
-	int count = 0;
+static int appendApplications(FridaDevice *device, GCancellable *cancellable, GString *dump, GError **error) {
 	FridaApplicationList *list;
 	GArray *applications;
 	gint num_applications, i;
-	GError *error;
 	guint pid_column_width, name_column_width;
 
-	if (r2f_debug ()) {
-		printf ("dump-apps\n");
+	list = frida_device_enumerate_applications_sync (device, cancellable, error);
+	if (!list) {
 		return 0;
 	}
-
-	dump = g_string_sized_new (8192);
-
-	error = NULL;
-        list = frida_device_enumerate_applications_sync (device, cancellable, &error);
-	if (error != NULL) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-			eprintf ("error: %s\n", error->message);
-		}
-		goto beach;
-	}
 	num_applications = frida_application_list_size (list);
 
 	applications = g_array_sized_new (FALSE, FALSE, sizeof (FridaApplication *), num_applications);
@@ -1725,39 +3602,22 @@ static int dumpApplications(FridaDevice *device, GCancellable *cancellable) {
 			pid_column_width, frida_application_get_pid (application),
 			frida_application_get_name (application));
 	}
-	count = num_applications;
-
-	r_cons_printf ("%s\n", dump->str);
 
-beach:
-	g_clear_error (&error);
-	g_clear_object (&list);
+	g_array_free (applications, TRUE);
+	g_object_unref (list);
 
-	g_string_free (dump, TRUE);
-	return count;
+	return num_applications;
 }
 
-static void dumpProcesses(FridaDevice *device, GCancellable *cancellable) {
-	if (r2f_debug ()) {
-		printf ("dump-procs\n");
-		return;
-	}
-	GString *dump;
+static int appendProcesses(FridaDevice *device, GCancellable *cancellable, GString *dump, GError **error) {
 	FridaProcessList *list;
 	GArray *processes;
 	gint num_processes, i;
-	GError *error;
 	guint pid_column_width, name_column_width;
 
-	dump = g_string_sized_new (8192);
-
-	error = NULL;
-	list = frida_device_enumerate_processes_sync (device, cancellable, &error);
-	if (error) {
-		if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-			eprintf ("error: %s\n", error->message);
-		}
-		goto beach;
+	list = frida_device_enumerate_processes_sync (device, cancellable, error);
+	if (!list) {
+		return 0;
 	}
 	num_processes = frida_process_list_size (list);
 
@@ -1805,13 +3665,195 @@ static void dumpProcesses(FridaDevice *device, GCancellable *cancellable) {
 			frida_process_get_name (process));
 	}
 
-	r_cons_printf ("%s\n", dump->str);
+	g_array_free (processes, TRUE);
+	g_object_unref (list);
+
+	return num_processes;
+}
+
+static void probe_parent_cancelled(GCancellable *parent, gpointer user_data) {
+	g_cancellable_cancel (G_CANCELLABLE (user_data));
+}
+
+static RFProbe *probe_new(RFProbeKind kind, FridaDeviceManager *manager, FridaDevice *device, const char *device_id, GCancellable *parent) {
+	RFProbe *p = R_NEW0 (RFProbe);
+	p->kind = kind;
+	p->manager = manager? g_object_ref (manager): NULL;
+	p->device = device? g_object_ref (device): NULL;
+	p->device_id = device_id? strdup (device_id): NULL;
+	p->cancellable = g_cancellable_new ();
+	if (parent) {
+		// runs right away when the parent is already cancelled
+		p->parent = g_object_ref (parent);
+		p->parent_handler = g_cancellable_connect (parent, G_CALLBACK (probe_parent_cancelled),
+			g_object_ref (p->cancellable), g_object_unref);
+	}
+	p->out = g_string_sized_new (8192);
+	return p;
+}
+
+static void probe_free(RFProbe *p) {
+	if (p) {
+		if (p->parent) {
+			g_cancellable_disconnect (p->parent, p->parent_handler);
+			g_object_unref (p->parent);
+		}
+		g_clear_object (&p->device);
+		g_clear_object (&p->manager);
+		g_object_unref (p->cancellable);
+		g_string_free (p->out, TRUE);
+		free (p->device_id);
+		free (p->error);
+		free (p);
+	}
+}
+
+static int probe_timeout(void) {
+	int ms = 5000;
+	char *env = r_sys_getenv ("R2FRIDA_PROBE_TIMEOUT");
+	if (R_STR_ISNOTEMPTY (env)) {
+		ms = atoi (env);
+	}
+	free (env);
+	return ms;
+}
 
-beach:
+static gpointer probe_thread(gpointer user_data) {
+	RFProbe *p = user_data;
+	GError *error = NULL;
+	int count = 0;
+	switch (p->kind) {
+	case RF_PROBE_DEVICES:
+		count = p->manager? appendDevices (p->manager, p->cancellable, p->out, &error): 0;
+		break;
+	case RF_PROBE_APPS:
+		count = p->device? appendApplications (p->device, p->cancellable, p->out, &error): 0;
+		break;
+	case RF_PROBE_PROCS:
+		count = p->device? appendProcesses (p->device, p->cancellable, p->out, &error): 0;
+		break;
+	case RF_PROBE_RESOLVE:
+		p->device = p->manager? get_device_manager (p->manager, p->device_id, p->cancellable, &error): NULL;
+		count = p->device? 1: 0;
+		break;
+	}
+	g_mutex_lock (&probe_lock);
+	p->count = count;
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		p->cancelled = true;
+	} else if (error) {
+		p->error = strdup (error->message);
+	} else if (!p->device && p->kind != RF_PROBE_DEVICES) {
+		p->error = strdup ("Cannot find device");
+	}
+	p->done = true;
+	const bool abandoned = p->abandoned;
+	g_cond_broadcast (&probe_cond);
+	g_mutex_unlock (&probe_lock);
 	g_clear_error (&error);
-	g_clear_object (&list);
+	if (abandoned) {
+		probe_free (p);
+	}
+	return NULL;
+}
+
+/* queries all the devices at once, probes still running after the timeout are cancelled and left behind */
+static void probe_run(RFProbe **probes, int n) {
+	const gint64 deadline = g_get_monotonic_time () + (gint64)probe_timeout () * G_TIME_SPAN_MILLISECOND;
+	int i, pending;
+	for (i = 0; i < n; i++) {
+		g_thread_unref (g_thread_new ("r2frida-probe", probe_thread, probes[i]));
+	}
+	g_mutex_lock (&probe_lock);
+	do {
+		pending = 0;
+		for (i = 0; i < n; i++) {
+			pending += !probes[i]->done;
+		}
+	} while (pending > 0 && g_cond_wait_until (&probe_cond, &probe_lock, deadline));
+	for (i = 0; i < n; i++) {
+		if (!probes[i]->done) {
+			g_cancellable_cancel (probes[i]->cancellable);
+			probes[i]->abandoned = true;
+			probes[i] = NULL;
+		}
+	}
+	g_mutex_unlock (&probe_lock);
+}
+
+/* returns the number of entries shown, the listing of a device that did not answer is replaced by a notice */
+static int probe_print(RFProbe *p) {
+	if (!p) {
+		eprintf ("error: no answer after %d ms, see R2FRIDA_PROBE_TIMEOUT\n", probe_timeout ());
+		return 0;
+	}
+	if (p->cancelled) {
+		return 0;
+	}
+	if (p->error) {
+		eprintf ("error: %s\n", p->error);
+		return 0;
+	}
+	r_cons_printf ("%s\n", p->out->str);
+	return p->count;
+}
+
+static void dumpDevices(GCancellable *cancellable) {
+	if (r2f_debug ()) {
+		printf ("dump-devices\n");
+		return;
+	}
+	RFProbe *probe = probe_new (RF_PROBE_DEVICES, device_manager, NULL, NULL, cancellable);
+	probe_run (&probe, 1);
+	probe_print (probe);
+	probe_free (probe);
+}
+
+static int dumpApplications(FridaDevice *device, GCancellable *cancellable) {
+	if (r2f_debug ()) {
+		printf ("dump-apps\n");
+		return 0;
+	}
+	RFProbe *probe = probe_new (RF_PROBE_APPS, NULL, device, NULL, cancellable);
+	probe_run (&probe, 1);
+	int count = probe_print (probe);
+	probe_free (probe);
+	return count;
+}
+
+static void dumpProcesses(FridaDevice *device, GCancellable *cancellable) {
+	if (r2f_debug ()) {
+		printf ("dump-procs\n");
+		return;
+	}
+	RFProbe *probe = probe_new (RF_PROBE_PROCS, NULL, device, NULL, cancellable);
+	probe_run (&probe, 1);
+	probe_print (probe);
+	probe_free (probe);
+}
 
-	g_string_free (dump, TRUE);
+/* apps and processes are enumerated at the same time, the processes are only shown when there are no apps */
+static void dumpApplicationsOrProcesses(FridaDevice *device, GCancellable *cancellable) {
+	if (r2f_debug ()) {
+		printf ("dump-apps\n");
+		printf ("dump-procs\n");
+		return;
+	}
+	RFProbe *probes[2] = {
+		probe_new (RF_PROBE_APPS, NULL, device, NULL, cancellable),
+		probe_new (RF_PROBE_PROCS, NULL, device, NULL, cancellable),
+	};
+	probe_run (probes, 2);
+	if (!probes[0] || probes[0]->error || probes[0]->count == 0) {
+		if (!probes[0]) {
+			probe_print (NULL);
+		}
+		probe_print (probes[1]);
+	} else {
+		probe_print (probes[0]);
+	}
+	probe_free (probes[0]);
+	probe_free (probes[1]);
 }
 
 static gint compareDevices(gconstpointer element_a, gconstpointer element_b) {
@@ -1885,10 +3927,18 @@ RIOPlugin r_io_plugin_frida = {
 };
 
 #ifndef R2_PLUGIN_INCORE
+/* called by r2 when it unloads the plugin on quit, while frida is still up */
+static void session_reuse_fini(void *data) {
+	if (reused_session && reused_session->refs == 0) {
+		session_reuse_drop ();
+	}
+}
+
 R_API RLibStruct radare_plugin = {
 	.type = R_LIB_TYPE_IO,
 	.data = &r_io_plugin_frida,
 	.version = R2_VERSION,
+	.free = session_reuse_fini,
 #if R2_VERSION_MAJOR >= 4 && R2_VERSION_MINOR >= 2
 	.pkgname = "r2frida"
 #endif
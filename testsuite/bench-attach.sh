@@ -0,0 +1,37 @@
+#!/bin/sh
+# Attach to and detach from a local stand-in process N times and report
+# the attach latency percentiles, overall and for every phase of the open.
+#
+#   $ make bench
+#   $ sh testsuite/bench-attach.sh 50
+#
+# R2 selects the radare2 binary, the io_frida plugin must be installed.
+
+N=${1:-20}
+R2=${R2:-r2}
+LOG=$(mktemp)
+
+sleep 3600 &
+PID=$!
+trap 'kill $PID 2>/dev/null; rm -f "$LOG"' EXIT INT TERM
+
+i=0
+fails=0
+while [ "$i" -lt "$N" ]; do
+	out=$(R2FRIDA_TIMINGS=1 "$R2" -qc q "frida://attach/$PID" 2>&1 >/dev/null | grep '^r2frida: ')
+	case "$out" in
+	*"r2frida: total"*) echo "$out" >> "$LOG" ;;
+	*) fails=$((fails + 1)) ;;
+	esac
+	i=$((i + 1))
+done
+
+echo "attach/detach of pid $PID, $N runs, $fails failed"
+printf "%-16s %10s %10s %10s %10s\n" phase p50 p90 p99 max
+for phase in $(awk '{print $2}' "$LOG" | awk '!seen[$0]++'); do
+	awk -v p="$phase" '$2 == p {print $3}' "$LOG" | sort -n | awk -v p="$phase" '
+		{ v[NR] = $1 }
+		function pct(q,  k) { k = int(NR * q + 0.999); if (k < 1) k = 1; return v[k] }
+		END { if (NR) printf "%-16s %10.2f %10.2f %10.2f %10.2f\n", p, pct(0.5), pct(0.9), pct(0.99), v[NR] }'
+done
+[ "$fails" -eq 0 ]